@@ -0,0 +1,125 @@
+#include "arena.h"
+#include "buffer_pool.h"
+
+using namespace std;
+
+arena::arena() : pos(nullptr), end(nullptr), blocks(nullptr)
+{
+	for (auto & f : free_list) f = nullptr;
+}
+
+arena::~arena()
+{
+	while (blocks) {
+		auto b = blocks;
+		blocks = b->next;
+		buffer_pool::global().release(b, b->size);
+	}
+}
+
+void * arena::new_block(size_t size)
+{
+	auto b = (block *)buffer_pool::global().alloc(size, false);
+	b->next = blocks;
+	b->size = size;
+	blocks = b;
+	return b + 1;
+}
+
+size_t arena::size_class(size_t size)
+{
+	size_t c = min_shift;
+	while ((size_t(1) << c) < size) c++;
+	return c;
+}
+
+void * arena::alloc(size_t size)
+{
+	auto c = size_class(size);
+	size_t bytes = size_t(1) << c;
+
+	lock_guard<mutex> lock(m);
+
+	if (auto b = free_list[c]) {
+		free_list[c] = b->next;
+		return b;
+	}
+
+	if (bytes > max_small) {
+		return new_block(sizeof(block) + bytes);
+	}
+
+	// blocks are powers of two, so they stay aligned in the chunk
+
+	if (size_t(end - pos) < bytes) {
+		pos = (uint8_t *)new_block(chunk_size);
+		end = pos + chunk_size - sizeof(block);
+	}
+	auto p = pos;
+	pos += bytes;
+	return p;
+}
+
+void arena::release(void * p, size_t size)
+{
+	auto c = size_class(size);
+	auto b = (free_block *)p;
+
+	lock_guard<mutex> lock(m);
+	b->next = free_list[c];
+	free_list[c] = b;
+}
+
+arena_buffer & arena_buffer::operator=(arena_buffer && b)
+{
+	if (this != &b) {
+		if (ptr) owner->release(ptr, len);
+		owner = b.owner;
+		ptr = b.ptr;
+		len = b.len;
+		b.ptr = nullptr;
+	}
+	return *this;
+}
+
+namespace {
+
+	// Header in front of every arena_object, keeps alignment of the object.
+
+	struct alignas(16) object_header {
+		arena * owner;				// nullptr for heap
+		size_t size;
+	};
+}
+
+void * arena_object::operator new(size_t size)
+{
+	auto h = (object_header *)::operator new(sizeof(object_header) + size);
+	h->owner = nullptr;
+	h->size = size;
+	return h + 1;
+}
+
+void * arena_object::operator new(size_t size, arena & a)
+{
+	auto h = (object_header *)a.alloc(sizeof(object_header) + size);
+	h->owner = &a;
+	h->size = size;
+	return h + 1;
+}
+
+void arena_object::operator delete(void * p)
+{
+	if (!p) return;
+	auto h = (object_header *)p - 1;
+	if (h->owner) {
+		h->owner->release(h, sizeof(object_header) + h->size);
+	} else {
+		::operator delete(h);
+	}
+}
+
+void arena_object::operator delete(void * p, arena &)
+{
+	operator delete(p);
+}
@@ -0,0 +1,119 @@
+/*
+Arena allocator
+
+Every disk owns an arena, which holds the working memory of the image: filesystem, dir and file objects
+and their sector buffers. Memory is taken from 64K chunks of buffer_pool, blocks returned to the arena
+are kept in free lists by size class (powers of two) and reused by following allocations, so opening
+files does not go to the heap. When the disk is deleted, the arena returns all chunks to the pool at once.
+
+Objects allocated in the arena must be deleted (or just abandoned) before the disk.
+The arena is locked, because readers may open files of the same disk from more threads.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+class arena
+{
+public:
+	arena();
+	~arena();
+
+	void * alloc(size_t size);
+	void release(void * p, size_t size);
+
+private:
+	arena(const arena &) = delete;
+	arena & operator=(const arena &) = delete;
+
+	enum {
+		chunk_size = 64 * 1024,
+		max_small  = chunk_size / 8,		// larger blocks get their own allocation
+		min_shift  = 4,						// smallest block is 16 bytes
+		classes    = sizeof(size_t) * 8
+	};
+
+	static size_t size_class(size_t size);
+
+	struct free_block {
+		free_block * next;
+	};
+
+	// Header of chunks and large blocks, they are linked, so the arena does not allocate to track them.
+
+	struct alignas(16) block {
+		block * next;
+		size_t size;
+	};
+
+	void * new_block(size_t size);
+
+	std::mutex m;
+	free_block * free_list[classes];
+	uint8_t * pos;							// free space in the current chunk
+	uint8_t * end;
+	block * blocks;
+};
+
+// Buffer in arena, returned to it when the handle is destroyed. New buffer is cleared.
+
+class arena_buffer
+{
+public:
+	arena_buffer() : owner(nullptr), ptr(nullptr), len(0) {}
+	arena_buffer(arena & a, size_t size) : owner(&a), ptr((uint8_t *)a.alloc(size)), len(size) { memset(ptr, 0, size); }
+	arena_buffer(arena_buffer && b) : owner(b.owner), ptr(b.ptr), len(b.len) { b.ptr = nullptr; }
+	~arena_buffer() { if (ptr) owner->release(ptr, len); }
+
+	arena_buffer & operator=(arena_buffer && b);
+
+	uint8_t * get() const { return ptr; }
+	operator uint8_t * () const { return ptr; }
+	size_t size() const { return len; }
+
+private:
+	arena_buffer(const arena_buffer &) = delete;
+	arena_buffer & operator=(const arena_buffer &) = delete;
+
+	arena * owner;
+	uint8_t * ptr;
+	size_t len;
+};
+
+// Allocator for containers of objects in arena, they release their memory with the object.
+
+template <class T> class arena_allocator
+{
+public:
+	typedef T value_type;
+
+	arena_allocator(arena & a) : a(&a) {}
+	template <class U> arena_allocator(const arena_allocator<U> & other) : a(other.a) {}
+
+	T * allocate(size_t n) { return (T *)a->alloc(n * sizeof(T)); }
+	void deallocate(T * p, size_t n) { a->release(p, n * sizeof(T)); }
+
+	bool operator==(const arena_allocator & other) const { return a == other.a; }
+	bool operator!=(const arena_allocator & other) const { return a != other.a; }
+
+	arena * a;
+};
+
+template <class T> using arena_vector = std::vector<T, arena_allocator<T>>;
+
+// Base of classes allocated in arena using new (a) T(...). Plain new allocates from the heap.
+// The object remembers where it came from, so delete works for both.
+
+class arena_object
+{
+public:
+	static void * operator new(size_t size);
+	static void * operator new(size_t size, arena & a);
+	static void operator delete(void * p);
+	static void operator delete(void * p, arena & a);		// constructor has thrown
+};
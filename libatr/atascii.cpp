@@ -0,0 +1,272 @@
+#include "atascii.h"
+#include <unordered_map>
+
+using namespace std;
+
+namespace {
+
+	struct name_char
+	{
+		byte len;
+		char text[4];
+	};
+
+	struct name_table
+	{
+		name_char c[128];
+
+		name_table()
+		{
+			const char * hex_digit = "0123456789ABCDEF";
+			for (int b = 0; b < 128; b++) {
+				auto & n = c[b];
+				if (b < 32 || b == 123 || b >= 125) {
+					n.len = 4;
+					n.text[0] = '\\'; n.text[1] = 'x'; n.text[2] = hex_digit[b >> 4]; n.text[3] = hex_digit[b & 0xf];
+				} else if (b == ' ' || b == '\\') {
+					n.len = 2;
+					n.text[0] = '\\'; n.text[1] = char(b);
+				} else {
+					n.len = 1;
+					n.text[0] = char(b);
+				}
+			}
+		}
+	};
+
+	const name_table & table()
+	{
+		static const name_table t;
+		return t;
+	}
+
+	// Unicode for ATASCII graphic characters $00 - $1F
+
+	const uint16_t graphic_chars[32] = {
+		0x2665, 0x251C, 0x2502, 0x2518, 0x2524, 0x2510, 0x2571, 0x2572,
+		0x25E2, 0x2597, 0x25E3, 0x259D, 0x2598, 0x2594, 0x2582, 0x2596,
+		0x2663, 0x250C, 0x2500, 0x253C, 0x25CF, 0x2584, 0x258E, 0x252C,
+		0x2534, 0x258C, 0x2514, 0x241B, 0x2191, 0x2193, 0x2190, 0x2192
+	};
+
+	const byte atascii_eol = 0x9B;
+	const byte atascii_tab = 0x7F;
+
+	uint32_t unicode_char(byte b)
+	{
+		if (b == atascii_eol) return '\n';
+		if (b >= 0x80) return 0xE000 + b;
+		if (b < 0x20) return graphic_chars[b];
+		switch (b) {
+		case 0x60: return 0x2666;
+		case 0x7B: return 0x2660;
+		case 0x7D: return 0x21B0;
+		case 0x7E: return 0x25C0;
+		case atascii_tab: return '\t';
+		}
+		return b;
+	}
+
+	struct utf8_char
+	{
+		byte len;
+		char text[3];
+	};
+
+	// UTF-8 form of every ATASCII character. Plain characters are the same in both encodings,
+	// runs of them are copied at once.
+
+	struct text_table
+	{
+		utf8_char c[256];
+		bool plain[256];						// ATASCII -> UTF-8
+		bool plain_utf8[128];					// UTF-8 -> ATASCII
+		unordered_map<uint32_t, byte> atascii;	// non ASCII Unicode characters
+
+		text_table()
+		{
+			for (int b = 0; b < 256; b++) {
+				auto u = unicode_char(byte(b));
+				auto & ch = c[b];
+				if (u < 0x80) {
+					ch.len = 1;
+					ch.text[0] = char(u);
+				} else if (u < 0x800) {
+					ch.len = 2;
+					ch.text[0] = char(0xC0 | (u >> 6));
+					ch.text[1] = char(0x80 | (u & 0x3F));
+				} else {
+					ch.len = 3;
+					ch.text[0] = char(0xE0 | (u >> 12));
+					ch.text[1] = char(0x80 | ((u >> 6) & 0x3F));
+					ch.text[2] = char(0x80 | (u & 0x3F));
+				}
+				plain[b] = (u == uint32_t(b));
+				if (u >= 0x80) atascii[u] = byte(b);
+			}
+			atascii[0x25B6] = atascii_tab;		// glyph of tab, used by older versions
+			for (int b = 0; b < 128; b++) {
+				plain_utf8[b] = b != '\n' && b != '\r' && b != '\t';
+			}
+		}
+	};
+
+	const text_table & text()
+	{
+		static const text_table t;
+		return t;
+	}
+
+	int hex_value(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		return -1;
+	}
+}
+
+size_t atascii_decode_name(const byte * name, size_t len, size_t ext_pos, char * out)
+{
+	auto & t = table();
+	bool inverse = false;
+	size_t p = 0, non_space = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (i == ext_pos && !inverse) {
+			p = non_space;
+			out[p++] = '.';
+		}
+		byte b = name[i];
+		bool inv = b >= 128;
+		if (inv != inverse) {
+			out[p++] = '\\'; out[p++] = 'i';
+			inverse = inv;
+		}
+		auto & c = t.c[b & 0x7f];
+		memcpy(out + p, c.text, sizeof(c.text));		// buffer has space for the longest form
+		p += c.len;
+		if (b != ' ' || inverse) non_space = p;
+	}
+	out[non_space] = 0;
+	return non_space;
+}
+
+bool atascii_encode_name(const char *& s, const char * end, char * name, size_t name_len, size_t ext_len)
+{
+	bool inverse = false;
+	auto len = name_len + ext_len;
+
+	for (size_t i = 0; i < len; i++) name[i] = ' ';
+	name[len] = 0;
+	size_t i = 0;
+	char c;
+
+	while (s < end) {
+		c = *s++;
+		if (c == ' ') {
+			if (i == 0) continue;
+			else break;
+		}
+		if (c == '\\' && s < end) {
+			c = *s++;
+			switch (c) {
+			case 'i':
+				inverse = !inverse;
+				continue;
+			case 'x': {
+				int hi = s < end ? hex_value(*s++) : -1;
+				int lo = s < end ? hex_value(*s++) : -1;
+				if (hi < 0 || lo < 0) throw "invalid hex character in filename";
+				c = char(hi * 16 + lo);
+				break;
+			}
+			}
+		} else if (c == '.' && i <= name_len) {
+			i = name_len;
+			continue;
+		}
+		if (i >= len) {
+			throw "filename too long";
+		}
+		name[i] = c | (inverse ? 128 : 0);
+		i++;
+	}
+	return i > 0;
+}
+
+size_t atascii_to_utf8(const byte * in, size_t size, char * out)
+{
+	auto & t = text();
+	size_t p = 0;
+
+	for (size_t i = 0; i < size;) {
+		auto run = i;
+		while (run < size && t.plain[in[run]]) run++;
+		if (run > i) {
+			memcpy(out + p, in + i, run - i);
+			p += run - i;
+			i = run;
+			continue;
+		}
+		auto & c = t.c[in[i++]];
+		memcpy(out + p, c.text, sizeof(c.text));
+		p += c.len;
+	}
+	return p;
+}
+
+size_t utf8_to_atascii(const char * in, size_t size, byte * out, size_t * used)
+{
+	auto & t = text();
+	auto s = (const byte *)in;
+	size_t p = 0, i = 0;
+
+	while (i < size) {
+		auto run = i;
+		while (run < size && s[run] < 0x80 && t.plain_utf8[s[run]]) run++;
+		if (run > i) {
+			memcpy(out + p, s + i, run - i);
+			p += run - i;
+			i = run;
+			continue;
+		}
+
+		byte b = s[i];
+		if (b == '\n') {
+			out[p++] = atascii_eol;
+			i++;
+		} else if (b == '\t') {
+			out[p++] = atascii_tab;
+			i++;
+		} else if (b == '\r') {
+			i++;
+		} else {
+			size_t len = (b >= 0xF0) ? 4 : (b >= 0xE0) ? 3 : (b >= 0xC0) ? 2 : 0;
+			if (len == 0) throw "invalid UTF-8 text";
+			if (i + len > size) break;
+			uint32_t u = b & (0x3F >> (len - 1));
+			for (size_t k = 1; k < len; k++) {
+				if ((s[i + k] & 0xC0) != 0x80) throw "invalid UTF-8 text";
+				u = (u << 6) | (s[i + k] & 0x3F);
+			}
+			auto it = t.atascii.find(u);
+			if (it == t.atascii.end()) throw "character can not be converted to ATASCII";
+			out[p++] = it->second;
+			i += len;
+		}
+	}
+	*used = i;
+	return p;
+}
+
+size_t utf8_atascii_size(const char * in, size_t size)
+{
+	// every character except CR is one ATASCII character, continuation bytes are not counted
+	size_t n = 0;
+	for (size_t i = 0; i < size; i++) {
+		auto b = byte(in[i]);
+		n += (b & 0xC0) != 0x80 && b != '\r';
+	}
+	return n;
+}
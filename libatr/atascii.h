@@ -0,0 +1,52 @@
+/*
+ATASCII codec
+
+Atari filenames are shown in printable form, where characters that can not be part of host filename are escaped:
+
+\i    turn inversion on / off
+\xhh  hex char
+\<sp> space
+\\    backslash
+
+Printable form of every character is precomputed in a table, so names are converted without per-character branching.
+*/
+
+#pragma once
+
+#include "disk.h"
+
+// Maximum length of printable form of name with len characters (including terminating zero).
+
+constexpr size_t atascii_name_size(size_t len) { return 6 * len + 4; }
+
+// Convert name stored on disk to printable form. Dot is inserted before extension at ext_pos (if it is less than len),
+// trailing spaces are removed. Returns length of the printable name.
+
+size_t atascii_decode_name(const byte * name, size_t len, size_t ext_pos, char * out);
+
+// Parse printable name from text between s and end into name_len + ext_len characters padded by spaces
+// (and zero terminated). Name ends with space or end of text, s is moved after it. Returns false if the name is empty.
+
+bool atascii_encode_name(const char *& s, const char * end, char * name, size_t name_len, size_t ext_len);
+
+/*
+Text files
+
+ATASCII text uses $9B as end of line and $7F as tab, graphic characters are converted to their Unicode equivalents
+and inverse characters (except EOL) to private use area U+E080 - U+E0FF, so the conversion is lossless.
+When converting from UTF-8, LF ends line, TAB and U+25B6 (glyph of tab) are converted to ATASCII tab and CR is ignored,
+so these do not survive conversion to ATASCII and back.
+*/
+
+// Convert ATASCII text to UTF-8. Output must have space for 3 * size bytes. Returns size of output.
+
+size_t atascii_to_utf8(const byte * in, size_t size, char * out);
+
+// Convert UTF-8 text to ATASCII. Output must have space for size bytes. Returns size of output.
+// Character split at the end of input is not converted, *used is set to number of converted input bytes.
+
+size_t utf8_to_atascii(const char * in, size_t size, byte * out, size_t * used);
+
+// Size of UTF-8 text converted to ATASCII (for valid text).
+
+size_t utf8_atascii_size(const char * in, size_t size);
@@ -0,0 +1,487 @@
+#include "batch_load.h"
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef ATR_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+	// Image data in memory, read by the image loaders as a stream.
+
+	class memory_streambuf : public streambuf
+	{
+	public:
+		memory_streambuf(const byte * data, size_t size)
+		{
+			auto p = (char *)data;
+			setg(p, p, p + size);
+		}
+
+	protected:
+		pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode which) override
+		{
+			auto base = (dir == ios_base::beg) ? eback() : (dir == ios_base::cur) ? gptr() : egptr();
+			auto p = base + off;
+			if (p < eback() || p > egptr()) return pos_type(off_type(-1));
+			setg(eback(), p, egptr());
+			return pos_type(p - eback());
+		}
+
+		pos_type seekpos(pos_type pos, ios_base::openmode which) override
+		{
+			return seekoff(off_type(pos), ios_base::beg, which);
+		}
+	};
+
+	struct loaded_file
+	{
+		size_t index;
+		vector<byte> data;
+		const char * error;
+	};
+
+	// State shared by readers and workers. Number of files being read or waiting for worker is limited,
+	// so memory use does not depend on the number of files.
+
+	class batch
+	{
+	public:
+		batch(const vector<string> & files, const batch_handler & handler, size_t max_loaded)
+			: files(files), handler(handler), max_loaded(max_loaded), next_read(0), loaded(0), processed(0)
+		{
+		}
+
+		const vector<string> & files;
+
+		// Reserve place for next file to read, returns false when all files have been started.
+		// Blocks while too many files are loaded, unless wait is false (then index is set to files.size()).
+		bool start(size_t & index, bool wait = true)
+		{
+			unique_lock<mutex> lock(m);
+			if (wait) {
+				space_cv.wait(lock, [this] { return next_read == files.size() || loaded < max_loaded; });
+			} else if (loaded >= max_loaded && next_read < files.size()) {
+				index = files.size();
+				return true;
+			}
+			if (next_read == files.size()) return false;
+			index = next_read++;
+			loaded++;
+			return true;
+		}
+
+		vector<byte> buffer()
+		{
+			lock_guard<mutex> lock(m);
+			vector<byte> b;
+			if (!pool.empty()) {
+				b.swap(pool.back());
+				pool.pop_back();
+			}
+			return b;
+		}
+
+		void deliver(size_t index, vector<byte> && data, const char * error)
+		{
+			{
+				lock_guard<mutex> lock(m);
+				ready.push_back(loaded_file{ index, move(data), error });
+			}
+			ready_cv.notify_one();
+		}
+
+		void worker()
+		{
+			for (;;) {
+				loaded_file f;
+				{
+					unique_lock<mutex> lock(m);
+					ready_cv.wait(lock, [this] { return !ready.empty() || processed == files.size(); });
+					if (ready.empty()) return;
+					f = move(ready.front());
+					ready.pop_front();
+				}
+
+				if (f.error) {
+					handler(f.index, nullptr, f.error);
+				} else {
+					try {
+						memory_streambuf buf(f.data.data(), f.data.size());
+						istream s(&buf);
+						unique_ptr<disk> d(disk::load(s, f.data.size(), files[f.index]));
+						handler(f.index, d.get(), nullptr);
+					} catch (const char * msg) {
+						handler(f.index, nullptr, msg);
+					}
+				}
+
+				bool last;
+				{
+					lock_guard<mutex> lock(m);
+					pool.push_back(move(f.data));
+					loaded--;
+					last = (++processed == files.size());
+				}
+				space_cv.notify_all();
+				if (last) ready_cv.notify_all();
+			}
+		}
+
+	private:
+		const batch_handler & handler;
+		size_t max_loaded;
+		size_t next_read;
+		size_t loaded;						// files being read or waiting for worker
+		size_t processed;
+
+		mutex m;
+		condition_variable space_cv;		// readers wait for free place
+		condition_variable ready_cv;		// workers wait for loaded file
+		deque<loaded_file> ready;
+		vector<vector<byte>> pool;
+	};
+
+	int open_file(const string & filename)
+	{
+#ifdef _WIN32
+		return _open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#else
+		return open(filename.c_str(), O_RDONLY);
+#endif
+	}
+
+	void close_file(int fd)
+	{
+#ifdef _WIN32
+		_close(fd);
+#else
+		close(fd);
+#endif
+	}
+
+	size_t file_size(int fd)
+	{
+#ifdef _WIN32
+		auto size = _lseeki64(fd, 0, SEEK_END);
+		_lseeki64(fd, 0, SEEK_SET);
+		return size_t(size);
+#else
+		struct stat st;
+		fstat(fd, &st);
+		return size_t(st.st_size);
+#endif
+	}
+
+	// Read whole file, returns error message or nullptr.
+
+	const char * read_file(const string & filename, vector<byte> & data)
+	{
+		int fd = open_file(filename);
+		if (fd < 0) return "file does not exist";
+		data.resize(file_size(fd));
+
+		size_t done = 0;
+		while (done < data.size()) {
+#ifdef _WIN32
+			auto n = _read(fd, data.data() + done, unsigned(min<size_t>(data.size() - done, 1 << 30)));
+#else
+			auto n = pread(fd, data.data() + done, data.size() - done, off_t(done));
+#endif
+			if (n <= 0) break;
+			done += size_t(n);
+		}
+		close_file(fd);
+		return (done == data.size()) ? nullptr : "file can not be read";
+	}
+
+	void pread_reader(batch & b)
+	{
+		size_t index;
+		while (b.start(index)) {
+			auto data = b.buffer();
+			auto error = read_file(b.files[index], data);
+			b.deliver(index, move(data), error);
+		}
+	}
+
+#ifdef ATR_IO_URING
+
+	// Minimal io_uring used by single thread, without liburing.
+
+	class uring
+	{
+	public:
+		uring(unsigned entries)
+		{
+			io_uring_params p;
+			memset(&p, 0, sizeof(p));
+			fd = int(syscall(__NR_io_uring_setup, entries, &p));
+			if (fd < 0) return;
+
+			sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+			sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+				unmap();
+				close(fd);
+				fd = -1;
+				return;
+			}
+
+			auto sq = (char *)sq_ring;
+			sq_head = (unsigned *)(sq + p.sq_off.head);
+			sq_tail = (unsigned *)(sq + p.sq_off.tail);
+			sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+			sq_array = (unsigned *)(sq + p.sq_off.array);
+			sq_entries = p.sq_entries;
+
+			auto cq = (char *)cq_ring;
+			cq_head = (unsigned *)(cq + p.cq_off.head);
+			cq_tail = (unsigned *)(cq + p.cq_off.tail);
+			cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+			cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+			to_submit = 0;
+			in_flight = 0;
+		}
+
+		~uring()
+		{
+			if (fd >= 0) {
+				unmap();
+				close(fd);
+			}
+		}
+
+		bool ok() const { return fd >= 0; }
+
+		// Queue read, returns false when submission queue is full.
+		bool read(int file, byte * buf, unsigned len, uint64_t offset, uint64_t user_data)
+		{
+			auto tail = *sq_tail;
+			if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) return false;
+			auto idx = tail & sq_mask;
+			auto & e = sqes[idx];
+			memset(&e, 0, sizeof(e));
+			e.opcode = IORING_OP_READ;
+			e.fd = file;
+			e.addr = uint64_t(uintptr_t(buf));
+			e.len = len;
+			e.off = offset;
+			e.user_data = user_data;
+			sq_array[idx] = idx;
+			__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+			to_submit++;
+			return true;
+		}
+
+		// Submit queued reads and wait for at least one completion.
+		// Transient errors (the kernel is short of resources or completion queue is full) are retried by the caller,
+		// false means io_uring failed, reads submitted before may still be in flight.
+		bool submit_and_wait()
+		{
+			auto n = syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+			if (n < 0) return transient(errno);
+			to_submit -= unsigned(n);
+			in_flight += unsigned(n);
+			return true;
+		}
+
+		// Wait for completion of all submitted reads, so the kernel no longer writes into their buffers.
+		// Results are dropped. Returns false if waiting failed.
+		bool wait_in_flight()
+		{
+			uint64_t user_data;
+			int result;
+			while (in_flight > 0) {
+				while (completion(user_data, result)) {}
+				if (in_flight == 0) break;
+				auto n = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				if (n < 0 && !transient(errno)) return false;
+			}
+			return true;
+		}
+
+		bool completion(uint64_t & user_data, int & result)
+		{
+			auto head = *cq_head;
+			if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+			auto & c = cqes[head & cq_mask];
+			user_data = c.user_data;
+			result = c.res;
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+			in_flight--;
+			return true;
+		}
+
+	private:
+		static bool transient(int error)
+		{
+			return error == EINTR || error == EAGAIN || error == EBUSY;
+		}
+
+		void unmap()
+		{
+			if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+			if (cq_ring != MAP_FAILED) munmap(cq_ring, cq_ring_size);
+			if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		}
+
+		int fd;
+		void * sq_ring;
+		void * cq_ring;
+		io_uring_sqe * sqes;
+		size_t sq_ring_size, cq_ring_size, sqes_size;
+		unsigned * sq_head, * sq_tail, * sq_array, * cq_head, * cq_tail;
+		unsigned sq_mask, cq_mask, sq_entries;
+		io_uring_cqe * cqes;
+		unsigned to_submit;				// queued, not yet passed to the kernel
+		unsigned in_flight;				// submitted, not yet completed
+	};
+
+	// Reads of one file are split into pieces of at most max_read bytes.
+
+	const size_t uring_depth = 32;
+	const size_t max_read = 1 << 20;
+
+	struct uring_read
+	{
+		size_t index;
+		int fd;
+		vector<byte> data;
+		size_t done;
+	};
+
+	// Returns false if io_uring can not be used, remaining files are then left for other readers.
+
+	bool uring_reader(batch & b)
+	{
+		vector<vector<byte>> abandoned;		// buffers of reads which could not be awaited, freed after the ring is closed
+		uring ring(uring_depth);
+		if (!ring.ok()) return false;
+
+		vector<uring_read> reads(uring_depth);
+		vector<size_t> free_slots;
+		for (size_t i = 0; i < uring_depth; i++) free_slots.push_back(i);
+		size_t active = 0;
+		bool more = true;
+
+		auto queue = [&](size_t slot) {
+			auto & r = reads[slot];
+			auto len = unsigned(min(r.data.size() - r.done, max_read));
+			ring.read(r.fd, r.data.data() + r.done, len, r.done, slot);
+		};
+
+		auto finish = [&](size_t slot, const char * error) {
+			auto & r = reads[slot];
+			close_file(r.fd);
+			b.deliver(r.index, move(r.data), error);
+			free_slots.push_back(slot);
+			active--;
+		};
+
+		while (more || active > 0) {
+
+			// start reading next files, wait for free place only when nothing is in flight
+
+			size_t index;
+			while (more && !free_slots.empty() && (more = b.start(index, active == 0)) && index < b.files.size()) {
+				auto data = b.buffer();
+				int fd = open_file(b.files[index]);
+				if (fd < 0) {
+					b.deliver(index, move(data), "file does not exist");
+					continue;
+				}
+				data.resize(file_size(fd));
+				if (data.empty()) {
+					close_file(fd);
+					b.deliver(index, move(data), nullptr);
+					continue;
+				}
+				auto slot = free_slots.back();
+				free_slots.pop_back();
+				reads[slot] = uring_read{ index, fd, move(data), 0 };
+				active++;
+				queue(slot);
+			}
+			if (active == 0) continue;
+
+			if (!ring.submit_and_wait()) {
+				// Files in flight fail, the rest is read by the fallback readers. Their buffers are passed on only after
+				// the kernel has completed the reads; if that can not be awaited, the buffers are kept until the ring
+				// is closed, which cancels the reads still in flight.
+				bool idle = ring.wait_in_flight();
+				for (size_t slot = 0; slot < uring_depth; slot++) {
+					if (find(free_slots.begin(), free_slots.end(), slot) != free_slots.end()) continue;
+					if (!idle) abandoned.push_back(move(reads[slot].data));
+					finish(slot, "file can not be read");
+				}
+				return false;
+			}
+
+			uint64_t slot;
+			int result;
+			while (ring.completion(slot, result)) {
+				auto & r = reads[slot];
+				if (result <= 0) {
+					finish(slot, "file can not be read");
+				} else if ((r.done += size_t(result)) == r.data.size()) {
+					finish(slot, nullptr);
+				} else {
+					queue(slot);
+				}
+			}
+		}
+		return true;
+	}
+
+#endif
+}
+
+void batch_load(const vector<string> & files, const batch_handler & handler, size_t threads)
+{
+	batch b(files, handler, 2 * threads + 16);
+
+	vector<thread> workers;
+	for (size_t i = 0; i < threads; i++) {
+		workers.emplace_back(&batch::worker, &b);
+	}
+
+	bool done = false;
+#ifdef ATR_IO_URING
+	done = uring_reader(b);
+#endif
+	if (!done) {
+		vector<thread> readers;
+		for (size_t i = 0; i < threads; i++) {
+			readers.emplace_back(pread_reader, ref(b));
+		}
+		for (auto & r : readers) r.join();
+	}
+
+	for (auto & w : workers) w.join();
+}
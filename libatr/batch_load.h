@@ -0,0 +1,24 @@
+/*
+Batch loading of disk images
+
+Loads many images (e.g. whole archive) while keeping several reads in flight. Images are read into pooled
+buffers by reader threads and decoded by worker threads, which pass the loaded disks to the handler.
+
+When compiled with ATR_IO_URING (Linux), the images are read by single thread using io_uring, so many reads
+are in flight without a thread for each of them. If io_uring is not available at runtime, or without the define,
+a pool of threads reads the images using pread.
+*/
+
+#pragma once
+
+#include "disk.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+// Handler is called from worker threads for every file, in any order. The disk is deleted when handler returns.
+// When the file can not be loaded, d is nullptr and error contains the reason.
+
+typedef std::function<void(size_t index, disk * d, const char * error)> batch_handler;
+
+void batch_load(const std::vector<std::string> & files, const batch_handler & handler, size_t threads = 4);
@@ -0,0 +1,107 @@
+#include "buffer_pool.h"
+#include "sparse_memory.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace {
+
+	const size_t class_size[] = {
+		1024,					// disk objects
+		64 * 1024,				// arena chunks
+		720 * 128,				// 90K
+		1040 * 128,				// 130K
+		720 * 256,				// 180K
+		1440 * 256,				// 360K
+		1024 * 1024,			// 1M
+		16 * 1024 * 1024		// 16M (65535 sectors of 256 bytes)
+	};
+
+	const size_t class_count = sizeof(class_size) / sizeof(class_size[0]);
+	static_assert(class_count == 8, "free_buffers must have entry for every class");
+
+	// Free buffers kept in every class
+
+	size_t class_limit(int c)
+	{
+		return max<size_t>(4, (64 << 20) / class_size[c]);
+	}
+
+	void free_buffer(void * p, size_t size)
+	{
+		if (size >= sparse_min_size) {
+			sparse_free(p, size);
+		} else {
+			free(p);
+		}
+	}
+}
+
+buffer_pool & buffer_pool::global()
+{
+	static buffer_pool pool;
+	return pool;
+}
+
+buffer_pool::~buffer_pool()
+{
+	for (size_t c = 0; c < class_count; c++) {
+		for (auto p : free_buffers[c]) free_buffer(p, class_size[c]);
+	}
+}
+
+int buffer_pool::size_class(size_t size)
+{
+	for (size_t c = 0; c < class_count; c++) {
+		if (size <= class_size[c]) return int(c);
+	}
+	return -1;
+}
+
+void * buffer_pool::alloc(size_t size, bool zero)
+{
+	auto c = size_class(size);
+	if (c >= 0) {
+		void * p = nullptr;
+		{
+			lock_guard<mutex> lock(m);
+			auto & list = free_buffers[c];
+			if (!list.empty()) {
+				p = list.back();
+				list.pop_back();
+			}
+		}
+		if (p) {
+			if (zero && class_size[c] < sparse_min_size) memset(p, 0, size);		// sparse buffers were cleared by release
+			return p;
+		}
+		size = class_size[c];
+	}
+
+	if (size >= sparse_min_size) return sparse_alloc(size);
+
+	auto p = zero ? calloc(size, 1) : malloc(size);
+	if (!p) throw "Not enough memory.";
+	return p;
+}
+
+// Pages of sparse buffers are returned to the system, so buffers kept in the pool do not hold memory.
+
+void buffer_pool::release(void * p, size_t size)
+{
+	auto c = size_class(size);
+	if (c >= 0) {
+		size = class_size[c];
+		if (size >= sparse_min_size) sparse_clear(p, size);
+
+		lock_guard<mutex> lock(m);
+		auto & list = free_buffers[c];
+		if (list.size() < class_limit(c)) {
+			list.push_back(p);
+			return;
+		}
+	}
+	free_buffer(p, size);
+}
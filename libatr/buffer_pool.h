@@ -0,0 +1,63 @@
+/*
+Buffer pool
+
+Disks, their buffers and arena chunks are taken from the pool and returned to it when the disk is deleted,
+so processing many images in one process reuses the same memory instead of allocating it for every image.
+
+Buffers are kept in size classes matching common disk sizes (90K single density, 130K enhanced density,
+180K double density, 360K double sided ...). A request is served from the smallest class it fits in,
+requests larger than the largest class go directly to the heap. Every class keeps a limited number
+of free buffers, so the pool does not hold more memory than a few batches of images need.
+
+Buffers of 1 MB and more are sparse (see sparse_memory.h), their untouched pages take no memory.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+class buffer_pool
+{
+public:
+	static buffer_pool & global();
+
+	// Buffer of at least size bytes. When zero is true, first size bytes are cleared.
+	void * alloc(size_t size, bool zero);
+
+	// Return buffer, size must be the same as passed to alloc.
+	void release(void * p, size_t size);
+
+	~buffer_pool();
+
+private:
+	buffer_pool() {}
+	buffer_pool(const buffer_pool &) = delete;
+	buffer_pool & operator=(const buffer_pool &) = delete;
+
+	static int size_class(size_t size);		// -1 if the size is too large
+
+	std::mutex m;
+	std::vector<void *> free_buffers[8];
+};
+
+// Array of trivial type in pooled buffer, cleared when zero is true.
+
+template <class T> class pool_array
+{
+public:
+	pool_array(size_t count, bool zero) : ptr((T *)buffer_pool::global().alloc(count * sizeof(T), zero)), count(count) {}
+	~pool_array() { buffer_pool::global().release(ptr, count * sizeof(T)); }
+
+	T * data() const { return ptr; }
+	T & operator[](size_t i) const { return ptr[i]; }
+	size_t size() const { return count; }
+
+private:
+	pool_array(const pool_array &) = delete;
+	pool_array & operator=(const pool_array &) = delete;
+
+	T * ptr;
+	size_t count;
+};
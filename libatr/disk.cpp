@@ -32,9 +32,15 @@ follow the "first 3 sectors must be 128 bytes long" rule.
 */
 
 #include "disk.h"
+#include "gzip.h"
+#include "buffer_pool.h"
+#include "host_writer.h"
+#include "sparse_memory.h"
 #include <iostream>
 #include <fstream>
 #include <cassert>
+#include <cstdlib>
+#include <cstdio>
 
 using namespace std;
 
@@ -50,234 +56,686 @@ enum atr_header
 	atr_header_size = 16			// size of the structure
 };
 
+enum dcm_archive_type
+{
+	dcm_archive       = 0xFA,	// single file archive
+	dcm_archive_multi = 0xF9	// part of multi file archive
+};
+
 disk::disk(size_t sector_size, sector_num sector_count) : s_size(sector_size), s_count(sector_count)
 {
-	data = new byte[byte_size()];
-	memset(data, 0, byte_size());
-	for (int i = 0; i < cache_size; i++) {
-		cache[i].init(*this);
-		cache[i].next = i + 1;
-		cache[i].prev = i - 1;
-	}
-	cache[0].prev = cache_size - 1;
-	cache[cache_size - 1].next = 0;
-	last = 0;
+	// buffers of deleted disks are reused, large ones are sparse, so untouched parts of large disks cost nothing
+	data = (byte *)buffer_pool::global().alloc(byte_size(), true);
 }
 
-disk * disk::load(const std::string & filename)
+disk::~disk()
 {
-	byte header[atr_header_size];
+	buffer_pool::global().release(data, byte_size());
+}
+
+void * disk::operator new(size_t size)
+{
+	return buffer_pool::global().alloc(size, false);
+}
 
+void disk::operator delete(void * p)
+{
+	if (p) buffer_pool::global().release(p, sizeof(disk));
+}
+
+disk * disk::load(const std::string & filename)
+{
 	ifstream f(filename, ios::binary);
+	if (!f.is_open()) throw "file does not exist";
 
-	f.read((char*)header, atr_header_size);
+	f.seekg(0, ios::end);
+	size_t file_size = size_t(f.tellg());
+	f.seekg(0);
 
-	if (header[atr_magic] != 0x96 || header[atr_magic + 1] != 0x02) throw("This file is not an Atari disk file.");	
-	size_t size = ((peek_word(header, atr_disk_size_hi) << 16) + peek_word(header, atr_disk_size)) * 16;
-	size_t sector_size = peek_word(header, atr_sector_size);
-	size_t boot_sector_size = (sector_size >= 256 && (size & 0xff) == 0) ? sector_size : 128;
+	return load(f, file_size, filename);
+}
 
-	sector_num sec_count = 3 + (size - 3 * boot_sector_size) / sector_size;
+disk * disk::load(std::istream & f, size_t file_size, const std::string & filename)
+{
+	auto format = detect_format(f, file_size, filename);
+	if (!format) throw "This file is not an Atari disk file.";
+	return format->load(f, file_size);
+}
+
+namespace {
 
-	disk * d = new disk(sector_size, sec_count);
+	// Stream writing directly into the buffer of host_writer.
 
-	byte * sec = new byte[sector_size];
+	class host_streambuf : public streambuf
+	{
+	public:
+		host_streambuf(host_writer & w) : w(w) { reset(); }
+
+	protected:
+		int_type overflow(int_type c) override
+		{
+			sync();
+			if (c != traits_type::eof()) {
+				*pptr() = char(c);
+				pbump(1);
+			}
+			return traits_type::not_eof(c);
+		}
 
-	for (size_t i = 1; i <= 3; i++) {
-		f.read((char *)sec, boot_sector_size);
-		d->write_sector(i, sec);
+		int sync() override
+		{
+			w.commit(size_t(pptr() - pbase()));
+			reset();
+			return 0;
+		}
+
+	private:
+		void reset()
+		{
+			auto p = (char *)w.buffer();
+			setp(p, p + w.available());
+		}
+
+		host_writer & w;
+	};
+}
+
+// Images are saved sparse, empty sectors of large disks do not take space on the host disk.
+// Image is written to temporary file, which replaces the file only when the whole image has been written,
+// so an image the format can not store (or failed write) does not destroy existing file.
+
+void disk::save(const std::string & filename)
+{
+	auto format = find_format(filename);
+	auto tmp_name = filename + ".tmp";
+	try {
+		host_writer w(tmp_name, 0, true);
+		host_streambuf buf(w);
+		ostream f(&buf);
+		format->save(*this, f);
+		f.flush();
+		if (!f) throw "can not write file";
+		w.close();
+	} catch (...) {
+		remove(tmp_name.c_str());
+		throw;
 	}
+#ifdef _WIN32
+	remove(filename.c_str());
+#endif
+	if (rename(tmp_name.c_str(), filename.c_str()) != 0) {
+		remove(tmp_name.c_str());
+		throw "can not write file";
+	}
+}
 
-	for (size_t i = 4; i <= sec_count; i++) {
-		f.read((char *)sec, sector_size);
-		d->write_sector(i, sec);
+//===== ATR
+
+static bool detect_atr(const byte * head, size_t file_size, const std::string & filename)
+{
+	return head[atr_magic] == 0x96 && head[atr_magic + 1] == 0x02;
+}
+
+static bool layout_atr(const byte * head, size_t file_size, disk::image_layout & l)
+{
+	size_t size = ((peek_word(head, atr_disk_size_hi) << 16) + peek_word(head, atr_disk_size)) * 16;
+	l.sector_size = peek_word(head, atr_sector_size);
+	if (l.sector_size != 128 && l.sector_size != 256 && l.sector_size != 512) throw "Unsupported sector size in ATR header.";
+	l.boot_sector_size = (l.sector_size >= 256 && (size & 0xff) == 0) ? l.sector_size : 128;
+	if (size < 3 * l.boot_sector_size || (size - 3 * l.boot_sector_size) % l.sector_size != 0) throw "Invalid disk size in ATR header.";
+	l.sector_count = 3 + (size - 3 * l.boot_sector_size) / l.sector_size;
+	l.offset = atr_header_size;
+	return true;
+}
+
+static disk * load_image(std::istream & f, const disk::image_layout & l)
+{
+	disk * d = new disk(l.sector_size, l.sector_count);
+
+	// Sectors are stored in the same order as in the disk buffer, so we can read them in place.
+	// Only padded boot sectors must be read one by one.
+
+	disk::sector_num first = 1;
+	if (l.boot_sector_size != 128) {
+		for (; first <= 3; first++) {
+			f.read((char *)d->sector_ptr(first), 128);
+			f.ignore(l.boot_sector_size - 128);
+		}
+	}
+	auto dst = d->sector_ptr(first);
+	auto size = d->byte_size() - (dst - d->sector_ptr(1));
+	if (d->byte_size() < sparse_min_size) {
+		f.read((char *)dst, size);
+		return d;
 	}
 
-	delete[] sec;
+	// Large disk is sparse, pages of empty sectors are not written to keep them unallocated.
 
+	pool_array<byte> buf(256 * 1024, false);
+	for (size_t done = 0; done < size;) {
+		f.read((char *)buf.data(), min(buf.size(), size - done));
+		auto n = size_t(f.gcount());
+		copy_nonzero(dst + done, buf.data(), n);
+		done += n;
+		if (!f) break;
+	}
 	return d;
 }
 
-void disk::save(const std::string & filename)
+static disk * load_atr(std::istream & f, size_t file_size)
 {
+	byte header[atr_header_size];
 
-	ofstream f(filename, ios::binary);
-	
+	f.read((char*)header, atr_header_size);
+
+	if (header[atr_magic] != 0x96 || header[atr_magic + 1] != 0x02) throw("This file is not an Atari disk file.");	
+
+	disk::image_layout l;
+	layout_atr(header, file_size, l);
+	return load_image(f, l);
+}
+
+static void save_atr(disk & d, std::ostream & f)
+{
 	byte header[atr_header_size];
 	memset(header, 0, atr_header_size);
 
 	header[atr_magic] = 0x96;
 	header[atr_magic + 1] = 0x02;
-	auto x = ((s_count - 3) * s_size + 3 * 128) / 16;
+	auto x = d.byte_size() / 16;
 
 	poke_word(header, atr_disk_size, x & 0xffff);
 	poke_word(header, atr_disk_size_hi, (x >> 16) & 0xffff)
-	poke_word(header, atr_sector_size, s_size);
+	poke_word(header, atr_sector_size, d.sector_size());
 
 	f.write((char *)header, atr_header_size);
+	f.write((char *)d.sector_ptr(1), d.byte_size());
+}
 
-	flush();
+//===== XFD
 
-	for (size_t i = 1; i <= 3; i++) {
-		f.write((char *)sector_ptr(i), 128);
-	}
+/*
+XFD is raw image of the disk without any header, so the geometry must be derived from the size of the file.
+Double density images have the boot sectors padded to 256 bytes.
+*/
 
-	for (size_t i = 4; i <= s_count; i++) {
-		if (i == 84) {
-			char * s = (char *)sector_ptr(i);
-			cout << "";
-		}
-		f.write((char *)sector_ptr(i), s_size);
-	}
-	f.close();
+static const size_t xfd_dd_size = 720 * 256;
+
+static bool detect_xfd(const byte * head, size_t file_size, const std::string & filename)
+{
+	if (disk::has_extension(filename, ".xfd")) return true;
+	return file_size == 720 * 128 || file_size == 1040 * 128 || file_size == xfd_dd_size || file_size == 2 * xfd_dd_size;
 }
 
-void disk::install_boot(const std::string & filename)
+static bool layout_xfd(const byte * head, size_t file_size, disk::image_layout & l)
 {
-	ifstream f(filename, ios::binary);
-	for (sector_num num = 1; num <= 3; num++) {
-		auto s = get_sector(num);		
-		f.read((char *)s->buf, 128);
-		s->dirty = true;
-	}
+	bool dd = file_size >= xfd_dd_size && (file_size % 256) == 0;
+	if (!dd && (file_size % 128) != 0) throw "Size of the XFD file is not multiple of sector size.";
+
+	l.sector_size = dd ? 256 : 128;
+	l.boot_sector_size = l.sector_size;
+	l.sector_count = file_size / l.sector_size;
+	l.offset = 0;
+	return true;
 }
 
-void disk::save_boot(const std::string & filename)
+static disk * load_xfd(std::istream & f, size_t file_size)
 {
-	byte buf[128];
-	ofstream f(filename, ios::binary);
-	for (sector_num s = 1; s <= 3; s++) {
-		read_sector(s, buf);
-		f.write((char *)buf, 128);
-	}
+	disk::image_layout l;
+	layout_xfd(nullptr, file_size, l);
+	return load_image(f, l);
 }
 
-disk::sector::sector()
+static void save_xfd(disk & d, std::ostream & f)
 {
-	dirty = false;
-	buf = nullptr;
+	disk::sector_num first = 1;
+	if (d.sector_size() != 128) {
+		char pad[512 - 128];
+		memset(pad, 0, sizeof(pad));
+		for (; first <= 3; first++) {
+			f.write((char *)d.sector_ptr(first), 128);
+			f.write(pad, d.sector_size() - 128);
+		}
+	}
+	f.write((char *)d.sector_ptr(first), d.byte_size() - (d.sector_ptr(first) - d.sector_ptr(1)));
 }
 
-void disk::sector::init(disk & d)
+/*
+
+DCM (DiskComm) archive
+
+The archive is composed of passes. Every pass starts with a header:
+
+Archive type <BYTE>: $FA (single file archive) or $F9 (multi file archive).
+
+Pass info <BYTE>: Bit 7 = 1 means this is the last pass.
+                  Bits 5-6 specify density: 00 = single (720 x 128), 01 = double (720 x 256), 10 = enhanced (1040 x 128).
+                  Bits 0-4 contain pass number.
+
+First sector <WORD>: Number of the first sector stored in the pass.
+
+The header is followed by sector blocks. Every block starts with type byte and is followed by data specific for the block type.
+If bit 7 of the type byte is set, the next block describes following sector. Otherwise number of the next sector (WORD)
+follows the block data. Empty sectors are not stored at all.
+
+Block data always modify the contents of the previous sector (empty sector at the start).
+
+$41 Modify begin   offset of the last changed byte, changed bytes in reverse order (from the offset down to 0)
+$42 DOS 2.0 sector last 5 bytes of the sector, first 123 bytes are filled with the first of them (128 byte sectors only)
+$43 Compressed     alternating literal and repeat segments, starting with literal one (which may be empty)
+                   literal: end offset followed by the bytes, repeat: end offset followed by the repeated byte
+                   end offset 0 means end of the sector
+$44 Modify end     offset of the first changed byte, changed bytes up to the end of the sector
+$45 Pass end
+$46 Same as previous sector
+$47 Uncompressed   whole sector
+
+*/
+
+enum dcm_block
 {
-	num = 0;
-	dirty = false;
-	buf = new byte[d.sector_size()];
+	dcm_modify_begin = 0x41,
+	dcm_dos_sector   = 0x42,
+	dcm_compressed   = 0x43,
+	dcm_modify_end   = 0x44,
+	dcm_pass_end     = 0x45,
+	dcm_same         = 0x46,
+	dcm_uncompressed = 0x47,
+	dcm_sequential   = 0x80,		// flag in block type
+};
+
+enum dcm_pass_info
+{
+	dcm_last_pass     = 0x80,
+	dcm_density_shift = 5,
+	dcm_density_mask  = 0x03,
+	dcm_pass_mask     = 0x1f
+};
+
+static const struct {
+	size_t sector_size;
+	disk::sector_num sector_count;
+} dcm_density[3] = {
+	{ 128, 720 },
+	{ 256, 720 },
+	{ 128, 1040 }
+};
+
+static byte dcm_get(std::istream & f)
+{
+	auto c = f.get();
+	if (c == EOF) throw "DCM archive is truncated";
+	return byte(c);
 }
 
-word disk::sector::dpeek(size_t offset) const
+static disk::sector_num dcm_get_word(std::istream & f)
 {
-	return buf[offset] + buf[offset + 1] * 256;
+	byte lo = dcm_get(f);
+	byte hi = dcm_get(f);
+	return lo + hi * 256;
 }
 
-void disk::sector::set(size_t offset, size_t size, byte b)
+static bool detect_dcm(const byte * head, size_t file_size, const std::string & filename)
 {
-	memset(buf + offset, b, size);
-	dirty = true;
+	return head[0] == dcm_archive || head[0] == dcm_archive_multi;
 }
 
-void disk::sector::copy(size_t offset, const char * ptr, size_t size)
+static disk * load_dcm(std::istream & f, size_t file_size)
 {
-	memcpy(buf + offset, ptr, size);
-	dirty = true;
+	disk * d = nullptr;
+	byte buf[256];
+	memset(buf, 0, sizeof(buf));
+
+	try {
+		byte pass_info;
+		do {
+			auto archive_type = dcm_get(f);
+			if (archive_type != dcm_archive && archive_type != dcm_archive_multi) throw "Invalid DCM pass header.";
+
+			pass_info = dcm_get(f);
+			auto density = (pass_info >> dcm_density_shift) & dcm_density_mask;
+			if (density > 2) throw "Unsupported DCM density.";
+
+			if (!d) {
+				d = new disk(dcm_density[density].sector_size, dcm_density[density].sector_count);
+			} else if (d->sector_size() != dcm_density[density].sector_size || d->sector_count() != dcm_density[density].sector_count) {
+				throw "DCM passes have different density.";
+			}
+
+			auto sec = dcm_get_word(f);
+
+			while (true) {
+				auto type = dcm_get(f);
+				if ((type & ~dcm_sequential) == dcm_pass_end) break;
+
+				if (sec < 1 || sec > d->sector_count()) throw "Invalid sector number in DCM archive.";
+				size_t size = d->sector_size(sec);
+
+				switch (type & ~dcm_sequential) {
+				case dcm_modify_begin:
+					for (int i = dcm_get(f); i >= 0; i--) {
+						buf[i] = dcm_get(f);
+					}
+					break;
+
+				case dcm_dos_sector:
+					if (size != 128) throw "DOS 2.0 block used in DCM with 256 byte sectors.";
+					f.read((char *)buf + 123, 5);
+					memset(buf, buf[123], 123);
+					break;
+
+				case dcm_compressed:
+					for (size_t i = 0; i < size; ) {
+						size_t end = dcm_get(f);
+						if (end < i) end = size;
+						if (end > size) throw "Invalid DCM block.";
+						while (i < end) buf[i++] = dcm_get(f);
+						if (i == size) break;
+						end = dcm_get(f);
+						if (end <= i) end = size;
+						if (end > size) throw "Invalid DCM block.";
+						memset(buf + i, dcm_get(f), end - i);
+						i = end;
+					}
+					break;
+
+				case dcm_modify_end:
+					for (size_t i = dcm_get(f); i < size; i++) {
+						buf[i] = dcm_get(f);
+					}
+					break;
+
+				case dcm_same:
+					break;
+
+				case dcm_uncompressed:
+					f.read((char *)buf, size);
+					break;
+
+				default:
+					throw "Unknown block type in DCM archive.";
+				}
+
+				if (!f) throw "DCM archive is truncated";
+
+				memcpy(d->sector_ptr(sec), buf, size);
+
+				if (type & dcm_sequential) {
+					sec++;
+				} else {
+					sec = dcm_get_word(f);
+				}
+			}
+		} while ((pass_info & dcm_last_pass) == 0);
+	} catch (...) {
+		delete d;
+		throw;
+	}
+
+	return d;
 }
 
-disk::sector::~sector()
+/*
+Encoders for particular DCM block types.
+Every encoder writes the block (without the type byte) to the out buffer and returns it's size.
+If the block type can not be used for the sector, 0 is returned.
+*/
+
+static size_t dcm_modify_begin_block(const byte * buf, const byte * prev, size_t size, byte * out)
 {
-//	delete[] buf;
-	buf = nullptr;
+	size_t last = size;
+	while (last > 0 && buf[last - 1] == prev[last - 1]) last--;
+	if (last == 0 || last == size) return 0;
+
+	size_t n = 0;
+	out[n++] = byte(last - 1);
+	for (size_t i = last; i > 0; i--) out[n++] = buf[i - 1];
+	return n;
 }
 
-void disk::write_sector(sector_num num, byte * data)
+static size_t dcm_modify_end_block(const byte * buf, const byte * prev, size_t size, byte * out)
 {
-//	cout << "writing " << num << "\n";
-//	if (num == 84) {
-//		cout << "Here!\n";
-//	}
-	auto adr = sector_ptr(num);
-	memcpy(sector_ptr(num), data, sector_size(num));
+	size_t first = 0;
+	while (first < size && buf[first] == prev[first]) first++;
+	if (first == 0 || first == size) return 0;
+
+	size_t n = 0;
+	out[n++] = byte(first);
+	for (size_t i = first; i < size; i++) out[n++] = buf[i];
+	return n;
 }
 
-void disk::flush(sector & s)
+static size_t dcm_dos_sector_block(const byte * buf, size_t size, byte * out)
 {
-	if (s.dirty) {
-		write_sector(s.num, s.buf);
-		s.dirty = false;
+	if (size != 128) return 0;
+	for (size_t i = 0; i < 123; i++) {
+		if (buf[i] != buf[123]) return 0;
 	}
+	memcpy(out, buf + 123, 5);
+	return 5;
 }
 
-void disk::flush()
+static size_t dcm_compressed_block(const byte * buf, size_t size, byte * out)
 {
-	for (auto & s : cache) {
-		flush(s);
+	// Only runs longer than 3 bytes pay off (repeat segment + new literal segment costs 3 bytes).
+	const size_t min_run = 4;
+	size_t n = 0, i = 0;
+
+	while (i < size) {
+
+		// find next run
+		size_t run = i, run_end = i;
+		while (run < size) {
+			run_end = run + 1;
+			while (run_end < size && buf[run_end] == buf[run]) run_end++;
+			if (run_end - run >= min_run) break;
+			run = run_end;
+		}
+
+		// literal segment (may be empty)
+		out[n++] = byte(run);
+		while (i < run) out[n++] = buf[i++];
+		if (i == size) break;
+
+		// repeat segment
+		out[n++] = byte(run_end);
+		out[n++] = buf[run];
+		i = run_end;
+
 	}
+	return n < size ? n : 0;
 }
 
-disk::sector * disk::get_sector(sector_num num, bool init)
+static void save_dcm(disk & d, std::ostream & f)
 {
-	auto & recent = cache[last];
+	auto s_size = d.sector_size();
+	auto s_count = d.sector_count();
 
-	if (recent.num == num) {
-		return &recent;
+	byte density;
+	for (density = 0; density < 3; density++) {
+		if (dcm_density[density].sector_size == s_size && dcm_density[density].sector_count == s_count) break;
 	}
+	if (density == 3) throw "DCM supports only 720 or 1040 sector disks with 128 bytes sectors or 720 sector disks with 256 bytes sectors.";
+
+	auto is_empty = [&d](disk::sector_num num) {
+		auto p = d.sector_ptr(num);
+		for (size_t i = 0; i < d.sector_size(num); i++) {
+			if (p[i]) return false;
+		}
+		return true;
+	};
+
+	auto next_sector = [&](disk::sector_num num) {
+		while (num <= s_count && is_empty(num)) num++;
+		return num;
+	};
+
+	byte prev[256], block[2 * 256];
+	memset(prev, 0, sizeof(prev));
+
+	auto sec = next_sector(1);
+
+	f.put(char(dcm_archive));
+	f.put(char(dcm_last_pass | (density << dcm_density_shift) | 1));
+	f.put(char(sec > s_count ? 1 : sec & 0xff));
+	f.put(char(sec > s_count ? 0 : sec >> 8));
+
+	while (sec <= s_count) {
+		auto buf = d.sector_ptr(sec);
+		auto size = d.sector_size(sec);
+
+		// Choose the shortest encoding of the sector
+
+		byte type = dcm_uncompressed;
+		size_t len = size;
+		const byte * data = buf;
+
+		if (memcmp(buf, prev, size) == 0) {
+			type = dcm_same;
+			len = 0;
+		} else {
+			byte tmp[2 * 256];
+			auto consider = [&](byte t, size_t n) {
+				if (n > 0 && n < len) {
+					type = t;
+					len = n;
+					memcpy(block, tmp, n);
+					data = block;
+				}
+			};
+			consider(dcm_dos_sector, dcm_dos_sector_block(buf, size, tmp));
+			consider(dcm_compressed, dcm_compressed_block(buf, size, tmp));
+			consider(dcm_modify_begin, dcm_modify_begin_block(buf, prev, size, tmp));
+			consider(dcm_modify_end, dcm_modify_end_block(buf, prev, size, tmp));
+		}
 
-	for (int i = 0; i < cache_size; i++) {
-		auto & s = cache[i];
-		if (s.num == num) {
-			cache[s.next].prev = s.prev;			
-			cache[s.prev].next = s.next;
-			if (i == last) last = cache[i].next;
-			//last = s.next;
-			s.next = last;
-			s.prev = cache[last].prev;
-			cache[last].prev = i;
-			cache[s.prev].next = i;
-
-			//print_cache();
-
-			return &s;
+		auto next = next_sector(sec + 1);
+		bool sequential = next == sec + 1 || next > s_count;
+
+		f.put(char(type | (sequential ? dcm_sequential : 0)));
+		f.write((const char *)data, len);
+		if (!sequential) {
+			f.put(char(next & 0xff));
+			f.put(char(next >> 8));
 		}
+
+		memcpy(prev, buf, size);
+		sec = next;
 	}
 
-	auto & s = cache[cache[last].next];
-	flush(s);
+	f.put(char(dcm_pass_end));
+}
+
+//===== Format registry
+
+const disk::image_format * disk::formats()
+{
+	// Formats without signature must be last, as they are recognized only by size or extension.
+	static const image_format list[] = {
+		{ "atr",  ".atr", detect_atr,  load_atr,  save_atr,  layout_atr },
+		{ "dcm",  ".dcm", detect_dcm,  load_dcm,  save_dcm,  nullptr },
+		{ "gzip", ".gz",  detect_gzip, load_gzip, save_gzip, nullptr },
+		{ "xfd",  ".xfd", detect_xfd,  load_xfd,  save_xfd,  layout_xfd },
+		{ nullptr, nullptr, nullptr, nullptr, nullptr, nullptr }
+	};
+	return list;
+}
+
+const disk::image_format * disk::detect_format(std::istream & f, size_t file_size, const std::string & filename)
+{
+	byte head[atr_header_size];
+	memset(head, 0, sizeof(head));
+
+	auto pos = f.tellg();
+	f.read((char *)head, sizeof(head));
+	f.clear();
+	f.seekg(pos);
+
+	return detect_format(head, file_size, filename);
+}
 
-	if (init) {
-		memset(s.buf, 0, sector_size());
-		s.dirty = true;
-	} else {
-		read_sector(num, s.buf);
+const disk::image_format * disk::detect_format(const byte * head, size_t file_size, const std::string & filename)
+{
+	for (auto format = formats(); format->name; format++) {
+		if (format->detect(head, file_size, filename)) return format;
 	}
-	s.num = num;
-	last = cache[last].next;
-	//print_cache();
-	return &s;
+	return nullptr;
 }
 
-disk::sector * disk::get_sector(sector_num num)
+const disk::image_format * disk::find_format(const std::string & filename)
 {
-	return get_sector(num, false);
+	for (auto format = formats(); format->name; format++) {
+		if (has_extension(filename, format->extension)) return format;
+	}
+	return formats();		// ATR is default
 }
 
-disk::sector * disk::init_sector(sector_num num)
+bool disk::has_extension(const std::string & filename, const char * extension)
 {
-	return get_sector(num, true);
+	auto len = strlen(extension);
+	if (filename.size() < len) return false;
+	for (size_t i = 0; i < len; i++) {
+		if (tolower(filename[filename.size() - len + i]) != tolower(extension[i])) return false;
+	}
+	return true;
 }
 
-void disk::print_cache()
+void disk::install_boot(const std::string & filename)
 {
-	for (auto cnt = 0, i=last; cnt < cache_size; cnt++) {
-		cout << cache[i].num << " ";
-		i = cache[i].next;
+	ifstream f(filename, ios::binary);
+	for (sector_num num = 1; num <= 3; num++) {
+		f.read((char *)sector_ptr(num), 128);
 	}
-	cout << "\n";
 }
 
+void disk::save_boot(const std::string & filename)
+{
+	byte buf[128];
+	ofstream f(filename, ios::binary);
+	for (sector_num s = 1; s <= 3; s++) {
+		read_sector(s, buf);
+		f.write((char *)buf, 128);
+	}
+}
+
+word disk::sector::dpeek(size_t offset) const
+{
+	return buf[offset] + buf[offset + 1] * 256;
+}
+
+void disk::sector::set(size_t offset, size_t size, byte b)
+{
+	memset(buf + offset, b, size);
+}
+
+void disk::sector::copy(size_t offset, const char * ptr, size_t size)
+{
+	memcpy(buf + offset, ptr, size);
+}
+
+void disk::write_sector(sector_num num, byte * data)
+{
+//	cout << "writing " << num << "\n";
+//	if (num == 84) {
+//		cout << "Here!\n";
+//	}
+	auto adr = sector_ptr(num);
+	memcpy(sector_ptr(num), data, sector_size(num));
+}
+
+// Sector which is already empty is not written, so pages of sparse disks stay unallocated.
+
+disk::sector disk::init_sector(sector_num num)
+{
+	auto p = sector_ptr(num);
+	if (!all_zero(p, sector_size(num))) memset(p, 0, sector_size(num));
+	return get_sector(num);
+}
 
 byte disk::read_byte(sector_num sector, size_t offset)
 {
 	auto s = get_sector(sector);
-	return s->peek(offset);
+	return s.peek(offset);
 }
 
 word disk::read_word(disk::sector_num sector, size_t offset)
@@ -297,18 +755,18 @@ word disk::read_word(disk::sector_num sector, size_t lo_offset, size_t hi_offset
 void disk::write_byte(sector_num sector, size_t offset, byte val)
 {
 	auto s = get_sector(sector);
-	s->poke(offset, val);
+	s.poke(offset, val);
 }
 
 void disk::write_word(sector_num sector, size_t offset, word val)
 {
 	auto s = get_sector(sector);
-	s->dpoke(offset, val);
+	s.dpoke(offset, val);
 }
 
 void disk::write_word(sector_num sector, size_t lo_offset, size_t hi_offset, word val)
 {
 	auto s = get_sector(sector);
-	s->poke(lo_offset, val & 0xff);
-	s->poke(hi_offset, (val >> 8) & 0xff);
+	s.poke(lo_offset, val & 0xff);
+	s.poke(hi_offset, (val >> 8) & 0xff);
 }
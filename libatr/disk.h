@@ -4,6 +4,9 @@
 #include <cstring>
 #include <stdint.h>
 #include <string>
+#include <iosfwd>
+#include <mutex>
+#include "arena.h"
 
 typedef uint8_t byte;
 typedef uint16_t word;
@@ -18,6 +21,11 @@ public:
 	typedef size_t sector_num;
 
 	disk(size_t sector_size, sector_num sector_count);
+	~disk();
+
+	// disk objects are reused by buffer_pool too
+	static void * operator new(size_t size);
+	static void operator delete(void * p);
 
 	sector_num sector_count() const {
 		return s_count;
@@ -36,32 +44,81 @@ public:
 	}
 
 	static disk * load(const std::string & filename);
+	static disk * load(std::istream & f, size_t file_size, const std::string & filename);
 	void save(const std::string & filename);
 
+	// Disk image container (ATR, DCM, XFD, ...)
+
+	// Placement of sectors in uncompressed image file.
+	// Boot sectors may be padded to the full sector size.
+
+	struct image_layout
+	{
+		size_t sector_size;
+		sector_num sector_count;
+		size_t boot_sector_size;
+		size_t offset;				// file offset of the first sector
+
+		size_t sector_offset(sector_num num) const {
+			return offset + ((num <= 3) ? (num - 1) * boot_sector_size : 3 * boot_sector_size + (num - 4) * sector_size);
+		}
+	};
+
+	struct image_format
+	{
+		const char * name;
+		const char * extension;
+		bool   (*detect)(const byte * head, size_t file_size, const std::string & filename);	// head contains first 16 bytes of the file
+		disk * (*load)(std::istream & f, size_t file_size);
+		void   (*save)(disk & d, std::ostream & f);
+		bool   (*layout)(const byte * head, size_t file_size, image_layout & l);	// nullptr for compressed formats, throws on invalid geometry
+	};
+
+	static const image_format * formats();
+	static const image_format * detect_format(std::istream & f, size_t file_size, const std::string & filename);
+	static const image_format * detect_format(const byte * head, size_t file_size, const std::string & filename);
+	static const image_format * find_format(const std::string & filename);
+	static bool has_extension(const std::string & filename, const char * extension);
+
 	void install_boot(const std::string & filename);
 	void save_boot(const std::string & filename);
 
 
+	/*
+	Threads
+
+	Sector data are accessed directly in the disk buffer, there is no cache. Reading does not modify
+	any shared state, so any number of threads may read the same disk concurrently.
+
+	Writes must be serialized by holding disk::writer for the whole modification (formatting, creating files ...).
+	Readers must not run concurrently with the writer.
+	*/
+
+	class writer
+	{
+	public:
+		writer(disk & d) : lock(d.write_mutex) {}
+	private:
+		std::lock_guard<std::mutex> lock;
+	};
+
+	// View of one sector in the disk buffer
+
 	struct sector {
-		int next, prev;
 		sector_num num;
-		bool dirty;
 		byte * buf;
 
-		void init(disk & d);
-		sector();
-		~sector();
+		sector() : num(0), buf(nullptr) {}
+		sector(sector_num num, byte * buf) : num(num), buf(buf) {}
 
 		void poke(size_t offset, byte value)
 		{
 			buf[offset] = value;
-			dirty = true;
 		}
 
 		void dpoke(size_t offset, word value)
 		{
 			poke_word(buf, offset, value)
-			dirty = true;
 		}
 
 		void copy(size_t offset, const char * ptr, size_t size);
@@ -74,12 +131,11 @@ public:
 
 	};
 
-	sector * get_sector(sector_num num, bool init);
-	sector * get_sector(sector_num num);
-	sector * init_sector(sector_num num);
+	sector get_sector(sector_num num) {
+		return sector(num, sector_ptr(num));
+	}
 
-	void flush();
-	void flush(sector & s);
+	sector init_sector(sector_num num);
 
 	void write_sector(sector_num num, byte * data);
 	void read_sector(sector_num num, byte * data)
@@ -87,6 +143,20 @@ public:
 		memcpy(data, sector_ptr(num), sector_size(num));
 	}
 
+	byte * sector_ptr(sector_num num) {
+		return &data[(num <= 3) ? (num - 1) * 128 : 3 * 128 + (num - 4) * s_size];
+	}
+
+	// Sector size known at compile time, 0 for sector size of the disk.
+	template <size_t SS> byte * sector_ptr(sector_num num) {
+		return &data[(num <= 3) ? (num - 1) * 128 : 3 * 128 + (num - 4) * (SS ? SS : s_size)];
+	}
+
+	// Working memory of filesystem objects opened on this disk, released with the disk.
+	arena & memory() {
+		return mem;
+	}
+
 	byte read_byte(sector_num sector, size_t offset);
 	word read_word(sector_num sector, size_t offset);
 	word read_word(sector_num sector, size_t lo_offset, size_t hi_offset);
@@ -97,19 +167,13 @@ public:
 
 private:
 
-	byte * sector_ptr(size_t num) {
-		return &data[(num <= 3) ? (num - 1) * 128 : 3 * 128 + (num - 4) * s_size];
-	}
+	disk(const disk &) = delete;
+	disk & operator=(const disk &) = delete;
 
 	size_t s_size;
 	sector_num s_count;
 	byte * data;
 
-	enum {
-		cache_size = 4
-	};
-
-	sector cache[cache_size];
-	int last;
-	void print_cache();
+	std::mutex write_mutex;
+	arena mem;
 };
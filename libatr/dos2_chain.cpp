@@ -0,0 +1,21 @@
+#include "dos2_chain.h"
+
+template <size_t SS> static const dos2_chain_ops & chain_ops()
+{
+	static const dos2_chain_ops ops = {
+		dos2_chain<SS>::map,
+		dos2_chain<SS>::size,
+		dos2_chain<SS>::read,
+		dos2_chain<SS>::fill
+	};
+	return ops;
+}
+
+const dos2_chain_ops & dos2_chain_ops::get(size_t sector_size)
+{
+	switch (sector_size) {
+	case 128: return chain_ops<128>();
+	case 256: return chain_ops<256>();
+	default:  return chain_ops<0>();
+	}
+}
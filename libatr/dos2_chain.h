@@ -0,0 +1,131 @@
+/*
+DOS 2 sector chains
+
+Files of DOS 2 and its derivatives are chains of sectors. Last 3 bytes of every data sector are the link:
+
+	sector_size - 3: file number << 2 | high bits of next sector number (whole high byte when file numbers are not used)
+	sector_size - 2: low byte of next sector number
+	sector_size - 1: number of data bytes in the sector
+
+The chain code is instantiated for sector sizes 128 and 256, so positions of the link bytes and size of the data
+are constants. Filesystem selects the instantiation by dos2_chain_ops::get once, when the image is opened.
+dos2_chain<0> takes sector size from the disk and is used for other sizes (512 byte sectors can not hold
+DOS 2 files, their data byte count does not fit in one byte).
+
+Data byte count greater than the data area (damaged sector) is limited to the data area.
+*/
+
+#pragma once
+
+#include "filesystem.h"
+#include <algorithm>
+
+template <size_t SS> class dos2_chain
+{
+public:
+	enum {
+		link_hi    = 3,			// offsets from the end of sector
+		link_lo    = 2,
+		link_count = 1
+	};
+
+	static size_t sector_size(disk & d) {
+		return SS ? SS : d.sector_size();
+	}
+
+	static size_t data_size(disk & d) {
+		return sector_size(d) - 3;
+	}
+
+	static byte * sector(disk & d, disk::sector_num num) {
+		return d.sector_ptr<SS>(num);
+	}
+
+	static disk::sector_num next(disk & d, const byte * s, byte hi_mask) {
+		auto end = s + sector_size(d);
+		return end[-link_lo] + ((end[-link_hi] & hi_mask) << 8);
+	}
+
+	static size_t count(disk & d, const byte * s) {
+		return std::min(size_t(s[sector_size(d) - link_count]), data_size(d));
+	}
+
+	static bool valid(disk & d, disk::sector_num num) {
+		return num != 0 && num <= d.sector_count();
+	}
+
+	// Add extent for every sector of the chain. Damaged chains are followed at most through all sectors of the disk.
+
+	static void map(disk & d, disk::sector_num sec, byte hi_mask, arena_vector<filesystem::data_extent> & extents)
+	{
+		size_t file_pos = 0;
+		for (disk::sector_num n = 0; valid(d, sec) && n < d.sector_count(); n++) {
+			auto s = sector(d, sec);
+			auto c = count(d, s);
+			extents.push_back({ file_pos, c, sec });
+			file_pos += c;
+			sec = next(d, s, hi_mask);
+		}
+	}
+
+	// Number of data bytes in the chain
+
+	static size_t size(disk & d, disk::sector_num sec, byte hi_mask)
+	{
+		size_t size = 0;
+		for (disk::sector_num n = 0; valid(d, sec) && n < d.sector_count(); n++) {
+			auto s = sector(d, sec);
+			size += count(d, s);
+			sec = next(d, s, hi_mask);
+		}
+		return size;
+	}
+
+	// Read from position in the chain, sector and pos are moved after the read data.
+	// Returns number of bytes read, less than size at the end of the chain.
+	// followed counts sectors entered after the first one, chain longer than the disk is cyclic.
+
+	static size_t read(disk & d, disk::sector_num & sec, size_t & pos, disk::sector_num & followed, byte hi_mask, byte * data, size_t size)
+	{
+		size_t done = 0;
+		while (done < size && sec != 0) {
+			auto s = sector(d, sec);
+			auto c = count(d, s);
+			if (pos >= c) {
+				auto n = next(d, s, hi_mask);
+				if (!valid(d, n)) break;
+				if (++followed >= d.sector_count()) throw "invalid sector chain";
+				sec = n;
+				pos = 0;
+				continue;
+			}
+			auto n = std::min(size - done, c - pos);
+			memcpy(data + done, s + pos, n);
+			pos += n;
+			done += n;
+		}
+		return done;
+	}
+
+	// Copy data to the data area of sector s from pos, returns number of bytes copied (0 if the sector is full).
+
+	static size_t fill(disk & d, byte * s, size_t & pos, const byte * data, size_t size)
+	{
+		auto n = std::min(size, data_size(d) - pos);
+		memcpy(s + pos, data, n);
+		pos += n;
+		return n;
+	}
+};
+
+// Chain operations for one sector size
+
+struct dos2_chain_ops
+{
+	void   (*map)(disk & d, disk::sector_num sec, byte hi_mask, arena_vector<filesystem::data_extent> & extents);
+	size_t (*size)(disk & d, disk::sector_num sec, byte hi_mask);
+	size_t (*read)(disk & d, disk::sector_num & sec, size_t & pos, disk::sector_num & followed, byte hi_mask, byte * data, size_t size);
+	size_t (*fill)(disk & d, byte * s, size_t & pos, const byte * data, size_t size);
+
+	static const dos2_chain_ops & get(size_t sector_size);
+};
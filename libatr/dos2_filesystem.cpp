@@ -1,5 +1,6 @@
 #include "dos2_filesystem.h"
 #include <cassert>
+#include <algorithm>
 
 using namespace std;
 
@@ -39,25 +40,25 @@ std::string dos2::name()
 	return "2";
 }
 
-bool dos2::detect(disk * d)
+int dos2::detect(const detect_info & info)
 {
-	if (d->sector_count() <= 720) {
-		if (d->read_byte(1, 0) == 0 && d->read_byte(VTOC_SECTOR, VTOC_VERSION) == 2) return true;
+	if (info.d->sector_count() <= 720 && info.vtoc) {
+		if (info.boot[0] == 0 && info.vtoc[VTOC_VERSION] == 2) return detect_likely;
 	}
-	return false;
+	return detect_none;
 }
 
 filesystem * dos2::format(disk * d)
 {
 
-	dos2 * fs = new dos2(d);
+	dos2 * fs = new (d->memory()) dos2(d);
 	fs->vtoc_format(2);
 	fs->dir_format();
 	return fs;
 }
 
 
-const filesystem::property * dos2::properties()
+const filesystem::property * dos2::property_table()
 {
 	static const filesystem::property props[3] = {
 		{ "DRIVES",   1, BOOT_DRIVES, 1},
@@ -68,7 +69,13 @@ const filesystem::property * dos2::properties()
 	return props;
 }
 
-dos2::dos2(disk * d, bool use_file_number,bool force_dos2_flag) : filesystem(d), use_file_number(use_file_number),force_dos2_flag(force_dos2_flag)
+const filesystem::property * dos2::properties()
+{
+	return property_table();
+}
+
+dos2::dos2(disk * d, bool use_file_number,bool force_dos2_flag) : filesystem(d), use_file_number(use_file_number),force_dos2_flag(force_dos2_flag),
+	chain(&dos2_chain_ops::get(d->sector_size()))
 {
 }
 
@@ -93,7 +100,7 @@ void dos2::dos2_dir::format()
 
 filesystem::dir * dos2::root_dir()
 {
-	return new dos2_dir(*this, DIR_FIRST_SECTOR);
+	return new (memory()) dos2_dir(*this, DIR_FIRST_SECTOR);
 }
 
 dos2::dos2_dir::dos2_dir(dos2 & fs, disk::sector_num first_sector) : fs(fs), first_sector(first_sector) 
@@ -102,6 +109,9 @@ dos2::dos2_dir::dos2_dir(dos2 & fs, disk::sector_num first_sector) : fs(fs), fir
 	sector = first_sector;
 	file_no = 0;
 	pos = 0;
+	if (fs.read_byte(sector, pos) == FLAG_NEVER_USED) {
+		sector = end_sector;
+	}
 }
 
 bool dos2::dos2_dir::at_end()
@@ -128,40 +138,28 @@ void dos2::dos2_dir::next()
 	}
 }
 
+// Position is the number of entry in directory.
+
+size_t dos2::dos2_dir::tell()
+{
+	return (sector - first_sector) * DIR_ENTRIES_PER_SECTOR + pos / DIR_ENTRY_SIZE;
+}
+
+void dos2::dos2_dir::seek(size_t entry)
+{
+	sector = first_sector + disk::sector_num(entry / DIR_ENTRIES_PER_SECTOR);
+	pos = (entry % DIR_ENTRIES_PER_SECTOR) * DIR_ENTRY_SIZE;
+	file_no = int(entry);
+}
+
 std::string dos2::dos2_dir::name()
 {
-	char t[4*24];
-	bool inverse = false;
-	size_t p = 0, non_space = 0;
-	for (size_t i = 5; i < 16; i++) {
-		if (i == 5 + 8 && !inverse) {
-			p = non_space;
-			t[p++] = '.';
-		}
-		byte b = fs.read_byte(sector, pos + i);
-		if (b >= 128) {
-			if (!inverse) {
-				inverse = true;
-				t[p++] = '\\'; t[p++] = 'i';
-			}
-			b = b & 0x7f;
-		} else {
-			if (inverse) {
-				t[p++] = '\\'; t[p++] = 'i';
-				inverse = false;
-			}
-		}
-		if (b < 32 || b == 123 || b >= 125) {
-			const char * hex_digit = "0123456789ABCDEF";
-			t[p++] = '\\'; t[p++] = 'x'; t[p++] = hex_digit[b >> 4]; t[p++] = hex_digit[b & 0xf];
-		} else {
-			if (b == ' ' || b == '\\') t[p++] = '\\';
-			char c = char(b);
-			t[p++] = c;
-		}
-		if (b != ' ' || inverse) non_space = p;
+	byte name[11];
+	for (size_t i = 0; i < 11; i++) {
+		name[i] = fs.read_byte(sector, pos + DIR_FILE_NAME + i);
 	}
-	t[non_space] = 0;
+	char t[atascii_name_size(11)];
+	atascii_decode_name(name, 11, 8, t);
 	return string(t);
 }
 
@@ -172,21 +170,43 @@ size_t dos2::dos2_dir::sec_size()
 
 size_t dos2::dos2_dir::size()
 {
-	size_t size = 0;
-	auto sec_size = fs.sector_size();
+	return chain_size(fs.read_word(sector, pos + DIR_FILE_START));
+}
 
-	disk::sector_num sec = fs.read_word(sector, pos + DIR_FILE_START);
-	while (sec) {
-		auto s = fs.get_sector(sec);
-		size += s->peek(sec_size - 1);
-		sec = s->peek(sec_size - 2) + ((s->peek(sec_size - 3) & 3) << 8);
+// Sum data bytes of sectors in file chain, damaged chains are followed at most through all sectors of the disk.
+
+size_t dos2::dos2_dir::chain_size(disk::sector_num sec)
+{
+	return fs.chain->size(*fs.d, sec, fs.link_mask());
+}
+
+void dos2::dos2_dir::snapshot(std::vector<entry> & entries)
+{
+	for (; sector < end_sector; sector++, pos = 0) {
+		auto s = fs.get_sector(sector);
+		for (; pos < DIR_ENTRIES_PER_SECTOR * DIR_ENTRY_SIZE; pos += DIR_ENTRY_SIZE) {
+			byte flags = s.peek(pos);
+			if (flags == FLAG_NEVER_USED) {
+				sector = end_sector;
+				return;
+			}
+			entry e;
+			set_entry_name(e, s.buf + pos + DIR_FILE_NAME, 11, 8);
+			e.flags = flags;
+			e.is_dir = is_dir_flag(flags);
+			e.is_deleted = (flags & FLAG_DELETED) != 0;
+			e.first_sector = s.dpeek(pos + DIR_FILE_START);
+			e.sec_size = s.dpeek(pos + DIR_FILE_SIZE);
+			e.size = (e.is_dir || e.is_deleted) ? 0 : chain_size(e.first_sector);
+			e.pos = tell();
+			entries.push_back(e);
+		}
 	}
-	return size;
 }
 
 filesystem::file * dos2::dos2_dir::open_file()
 {
-	return new dos2_file(fs, sector, pos, file_no, fs.read_word(sector, pos + DIR_FILE_START), sec_size(), false);
+	return new (fs.memory()) dos2_file(fs, sector, pos, file_no, fs.read_word(sector, pos + DIR_FILE_START), sec_size(), false);
 }
 
 dos2::dos2_file::dos2_file(dos2 & fs, disk::sector_num dir_sector, size_t dir_pos, int file_no, disk::sector_num first_sec, disk::sector_num sec_cnt, bool writing) :
@@ -195,10 +215,12 @@ dos2::dos2_file::dos2_file(dos2 & fs, disk::sector_num dir_sector, size_t dir_po
 	dir_pos(dir_pos), 
 	first_sec(first_sec), 
 	sec_cnt(sec_cnt), 
-	writing(writing) 
+	writing(writing),
+	data_map(fs.memory())
 {
 	pos = 0;
 	sector = 0;
+	followed = 0;
 	size = 0;
 	dos2_compatible = true;
 	if (!writing) {
@@ -209,16 +231,17 @@ dos2::dos2_file::dos2_file(dos2 & fs, disk::sector_num dir_sector, size_t dir_po
 int dos2::dos2_dir::alloc_entry(const char * name, byte flags, disk::sector_num first_sec, disk::sector_num * p_sector, size_t * p_offset)
 {
 	int file_no = 0;
-	
+	fs.dir_changed();
+
 	for (auto sec = first_sector; sec < end_sector; sec++) {
 		auto s = fs.get_sector(sec);
 		for (size_t i = 0; i < DIR_ENTRIES_PER_SECTOR * DIR_ENTRY_SIZE; i += DIR_ENTRY_SIZE) {
-			auto f = s->peek(i);
+			auto f = s.peek(i);
 			if (f == 0 || (f & FLAG_DELETED)) {
-				s->poke(i, flags);
-				s->dpoke(i + DIR_FILE_SIZE, 0);
-				s->dpoke(i + DIR_FILE_START, word(first_sec));
-				s->copy(i + DIR_FILE_NAME, name, 11);
+				s.poke(i, flags);
+				s.dpoke(i + DIR_FILE_SIZE, 0);
+				s.dpoke(i + DIR_FILE_START, word(first_sec));
+				s.copy(i + DIR_FILE_NAME, name, 11);
 				*p_sector = sec;
 				*p_offset = i;
 				return file_no;
@@ -234,7 +257,7 @@ filesystem::file * dos2::dos2_dir::create_file(char * name)
 	disk::sector_num sector;
 	size_t offset;
 	auto file_no = alloc_entry(name, FLAG_IN_USE | FLAG_OPENED, 0, &sector, &offset);
-	return new dos2_file(fs, sector, offset, file_no, 0, 0, true);
+	return new (fs.memory()) dos2_file(fs, sector, offset, file_no, 0, 0, true);
 }
 
 dos2::dos2_file::~dos2_file()
@@ -250,9 +273,9 @@ dos2::dos2_file::~dos2_file()
 		}
 
 		auto dir = fs.get_sector(dir_sector);
-		dir->poke(dir_pos, FLAG_IN_USE + (dos2_compatible ? FLAG_DOS2: 0) + (fs.use_file_number ? 0 : 0x04));
-		dir->dpoke(dir_pos + DIR_FILE_SIZE, word(sec_cnt));
-		dir->dpoke(dir_pos + DIR_FILE_START, word(first_sec));
+		dir.poke(dir_pos, FLAG_IN_USE + (dos2_compatible ? FLAG_DOS2: 0) + (fs.use_file_number ? 0 : 0x04));
+		dir.dpoke(dir_pos + DIR_FILE_SIZE, word(sec_cnt));
+		dir.dpoke(dir_pos + DIR_FILE_START, word(first_sec));
 	}
 }
 
@@ -267,9 +290,9 @@ void dos2::dos2_file::write_data_sector(disk::sector_num next)
 		assert(sec_hi <= 3);
 		sec_hi |= file_no << 2;
 	}
-	sec->poke(--p, byte(pos));
-	sec->poke(--p, sec_lo);
-	sec->poke(--p, sec_hi);
+	sec.poke(--p, byte(pos));
+	sec.poke(--p, sec_lo);
+	sec.poke(--p, sec_hi);
 	
 	sector = next;
 	if (sector > 720 && !fs.force_dos2_flag) {
@@ -281,7 +304,7 @@ void dos2::dos2_file::write_data_sector(disk::sector_num next)
 
 bool dos2::dos2_file::sector_end()
 {
-	return pos == fs.read_byte(sector, fs.sector_size() - 1);
+	return pos >= min<size_t>(fs.read_byte(sector, fs.sector_size() - 1), fs.sector_size() - 3);
 }
 
 disk::sector_num dos2::dos2_file::sector_next()
@@ -304,30 +327,35 @@ bool dos2::dos2_file::next_sector()
 {
 	disk::sector_num next = sector_next();
 	if (next == 0 || next > fs.sector_count()) return false;
+	if (++followed >= fs.sector_count()) throw "invalid sector chain";
 	sector = next;
 	pos = 0;	
 	return true;
 }
 
-bool dos2::dos2_file::eof()
+// Sector chain is followed once, then any part of file is read directly.
+
+size_t dos2::dos2_file::pread(size_t offset, byte * data, size_t size)
 {
-	do {
-		if (!sector_end()) return false;
-	} while (next_sector());	
-	return true;
+	if (data_map.empty()) {
+		fs.chain->map(*fs.d, first_sec, fs.link_mask(), data_map);
+	}
+	return fs.read_extents(data_map, offset, data, size);
 }
 
-byte dos2::dos2_file::read()
+size_t dos2::dos2_file::size_hint()
 {
-	while (sector_end()) {
-		if (!next_sector())
-			throw("EOF");
-	}
+	return fs.chain->size(*fs.d, first_sec, fs.link_mask());
+}
+
+// Reads follow the chain as far as possible, writes fill the data area of current sector.
 
-	return fs.read_byte(sector, pos++);
+size_t dos2::dos2_file::read_span(byte * data, size_t size)
+{
+	return fs.chain->read(*fs.d, sector, pos, followed, fs.link_mask(), data, size);
 }
 
-void dos2::dos2_file::write(byte b) 
+size_t dos2::dos2_file::write_span(const byte * data, size_t size)
 {
 	if (first_sec == 0) {
 		first_sec = fs.alloc_sector();
@@ -337,14 +365,22 @@ void dos2::dos2_file::write(byte b)
 		auto sec = fs.alloc_sector();
 		write_data_sector(sec);
 	}
+	auto n = fs.chain->fill(*fs.d, fs.d->sector_ptr(sector), pos, data, size);
+	this->size += n;
+	return n;
+}
 
-	fs.write_byte(sector, pos, b);
-	pos++;
-	size++;
+bool dos2::dos2_file::eof()
+{
+	do {
+		if (!sector_end()) return false;
+	} while (next_sector());	
+	return true;
 }
 
 
 
+
 /*
 VTOC buffer layout
 ==================
@@ -376,12 +412,12 @@ void dos2::vtoc_format(byte version)
 
 	auto vtoc = d->init_sector(VTOC_SECTOR);
 
-	vtoc->poke(VTOC_VERSION, version);							// DOS_2.0	
-	vtoc->dpoke(VTOC_CAPACITY, 707);
-	vtoc->dpoke(VTOC_FREE_SEC, 707+8+1);					// 719 - (3(boot) + 1(vtoc) + 8(dir))
-	vtoc->set(VTOC_BITMAP, VTOC_BITMAP_SIZE, 0xff);
+	vtoc.poke(VTOC_VERSION, version);							// DOS_2.0	
+	vtoc.dpoke(VTOC_CAPACITY, 707);
+	vtoc.dpoke(VTOC_FREE_SEC, 707+8+1);					// 719 - (3(boot) + 1(vtoc) + 8(dir))
+	vtoc.set(VTOC_BITMAP, VTOC_BITMAP_SIZE, 0xff);
 	
-	vtoc->poke(VTOC_BITMAP, 0x0f);							// first 4 sectors are used by boot	
+	vtoc.poke(VTOC_BITMAP, 0x0f);							// first 4 sectors are used by boot	
 	switch_sector_use(VTOC_SECTOR);
 	//for (auto sec = DIR_FIRST_SECTOR; sec < DIR_FIRST_SECTOR+DIR_SIZE; sec++) {
 	//	switch_sector_use(sec);
@@ -394,17 +430,17 @@ void dos2::switch_sector_use(disk::sector_num sec, byte count)
 		auto vtoc = get_sector(VTOC_SECTOR);
 		auto off = VTOC_BITMAP + sec / 8;
 		auto bit = 128 >> (sec & 7);
-		auto n = vtoc->peek(off);
+		auto n = vtoc.peek(off);
 		n ^= bit;
-		vtoc->poke(off, n);
+		vtoc.poke(off, n);
 
-		int free = vtoc->dpeek(VTOC_FREE_SEC);
+		int free = vtoc.dpeek(VTOC_FREE_SEC);
 		if (n & bit) {
 			free++;
 		} else {
 			free--;
 		}
-		vtoc->dpoke(VTOC_FREE_SEC, free);
+		vtoc.dpoke(VTOC_FREE_SEC, free);
 		sec++;
 	} while (--count > 0);
 }
@@ -414,7 +450,7 @@ bool dos2::find_free_sector(disk::sector_num vtoc_sec, size_t offset, size_t byt
 	auto vtoc = get_sector(vtoc_sec);
 
 	for (size_t i = 0; i < byte_count; i++) {		
-		if (auto b = vtoc->peek(offset + i)) {
+		if (auto b = vtoc.peek(offset + i)) {
 			byte sec = 0;
 			for (byte bit = 128; (b & bit) == 0; bit /= 2) {
 				sec++;
@@ -452,6 +488,18 @@ disk::sector_num dos2::free_sector_count()
 	return read_word(VTOC_SECTOR, VTOC_FREE_SEC);
 }
 
+disk::sector_num dos2::file_sectors(size_t size)
+{
+	// last 3 bytes of every sector link the next one
+	auto data = sector_size() - 3;
+	return (size + data - 1) / data;
+}
+
+size_t dos2::dir_capacity(bool root)
+{
+	return DIR_SIZE * DIR_ENTRIES_PER_SECTOR;
+}
+
 disk::sector_num dos2::get_dos_first_sector() 
 { 
 	return read_word(1, BOOT_FILE_LO, BOOT_FILE_HI);
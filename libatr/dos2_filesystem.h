@@ -15,6 +15,8 @@ Byte 10 - 99 : Bitmap showing allocation of sectors.The high - order bit of byte
 #pragma once
 
 #include "filesystem.h"
+#include "file_io.h"
+#include "dos2_chain.h"
 
 
 class dos2 : public filesystem
@@ -43,33 +45,40 @@ public:
 	~dos2();
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
 
 	std::string name() override;
 	const property * properties() override;
+	static const property * property_table();
 
 
 	disk::sector_num free_sector_count() override;
+	disk::sector_num file_sectors(size_t size) override;
+	size_t dir_capacity(bool root) override;
 
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
 
 	filesystem::dir * root_dir() override;
 
-	class dos2_file : public filesystem::file
+	class dos2_file : public file_io<dos2_file>
 	{
+		friend class file_io<dos2_file>;
 	public:
 
 		dos2_file(dos2 & fs, disk::sector_num dir_sector, size_t dir_pos, int file_no, disk::sector_num first_sec, disk::sector_num sec_cnt, bool writing);
 		~dos2_file();
 
 		bool eof() override;
-		byte read() override;
-		void write(byte b) override;
+		size_t pread(size_t offset, byte * data, size_t size) override;
+		size_t size_hint() override;
 		disk::sector_num first_sector() override;
 
 	protected:
 
+		size_t read_span(byte * data, size_t size);
+		size_t write_span(const byte * data, size_t size);
+
 		void write_data_sector(disk::sector_num next);
 		bool sector_end();
 		disk::sector_num sector_next();
@@ -82,6 +91,7 @@ public:
 		// current position
 		disk::sector_num sector;
 		size_t pos;
+		disk::sector_num followed;		// sectors of the chain passed, bounds reading of cyclic chains
 
 		bool writing;
 
@@ -93,6 +103,8 @@ public:
 		size_t sec_cnt;					// size if not known yet
 		size_t size;					// size in bytes
 		bool dos2_compatible;
+
+		arena_vector<filesystem::data_extent> data_map;	// data of every sector in chain, for pread
                 
 	};
 
@@ -108,9 +120,14 @@ public:
 		size_t size() override;
 		bool is_deleted() override;
 		file * create_file(char * name) override;
+		size_t tell() override;
+		void seek(size_t pos) override;
+		void snapshot(std::vector<entry> & entries) override;
 		void format();
 
 	protected:
+		virtual bool is_dir_flag(byte flags) { return false; }
+		size_t chain_size(disk::sector_num sec);
 		int alloc_entry(const char * name, byte flags, disk::sector_num first_sec, disk::sector_num * p_sector, size_t * p_offset);
 		dos2 & fs;
 		disk::sector_num first_sector;
@@ -139,4 +156,10 @@ protected:
 	bool use_file_number;
 	byte fs_file_flags;
     bool force_dos2_flag;
+
+	// Sector chains
+	const dos2_chain_ops * chain;			// code for the sector size of the disk
+	byte link_mask() {						// bits of sector number in high byte of the link
+		return use_file_number ? 3 : 0xff;
+	}
 };
@@ -1,4 +1,5 @@
 #include "dos_2_5.h"
+#include <algorithm>
 
 #define FLAG_NEVER_USED 0x00
 #define FLAG_DELETED 0x80
@@ -29,7 +30,7 @@ std::string dos25::name()
 }
 
 
-const filesystem::property * dos25::properties()
+const filesystem::property * dos25::property_table()
 {
 	static const filesystem::property props[3] = {
 		{ "DRIVES",   1, 0x0a, 1},
@@ -40,10 +41,15 @@ const filesystem::property * dos25::properties()
 	return props;
 }
 
-dos25::dos25(disk * d) : filesystem(d)
+const filesystem::property * dos25::properties()
+{
+	return property_table();
+}
+
+dos25::dos25(disk * d) : filesystem(d), chain(&dos2_chain_ops::get(d->sector_size()))
 {
 	vtoc_init();
-	vtoc_buf = new byte[VTOC_BUF_SIZE];  // we need only 128 for single density disk
+	vtoc_buf = arena_buffer(memory(), std::max(VTOC_BUF_SIZE, VTOC2_OFFSET + sector_size()));  // whole VTOC2 sector must fit after the offset
 	vtoc_read();
 }
 
@@ -51,18 +57,19 @@ dos25::~dos25()
 {
 	vtoc_write();
 //	delete[] dir_buf;
-	delete[] vtoc_buf;
 }
 
-bool dos25::detect(disk * d)
+int dos25::detect(const detect_info & info)
 {
-	return true; // this is default
+	// DOS 2.5 is the default, enhanced density disk with DOS 2 VTOC is likely formatted by it
+	if (info.vtoc && info.vtoc[0] == 2 && info.d->sector_count() >= 1024) return detect_likely;
+	return detect_fallback;
 }
 
 filesystem * dos25::format(disk * d)
 {
 
-	dos25 * fs = new dos25(d);
+	dos25 * fs = new (d->memory()) dos25(d);
 
 	fs->dir_format();
 	fs->vtoc_format();
@@ -89,18 +96,21 @@ void dos25::dos2_dir::format()
 	}
 }
 
-dos25::dos2_dir::dos2_dir(dos25 & fs, disk::sector_num sector) : fs(fs), first_sector(sector) {
-	end_sector = sector + DIR_SIZE;
+dos25::dos2_dir::dos2_dir(dos25 & fs, disk::sector_num first_sector) : fs(fs), first_sector(first_sector) {
+	end_sector = first_sector + DIR_SIZE;
 	sector = first_sector;
 	file_no = 1;
 	pos = 0;
-	buf = new byte[fs.sector_size()];
+	buf = arena_buffer(fs.memory(), fs.sector_size());
 	fs.read_sector(sector, buf);
+	if (buf[pos] == FLAG_NEVER_USED) {
+		sector = end_sector;
+	}
 }
 
 filesystem::dir * dos25::root_dir()
 {
-	return new dos2_dir(*this, DIR_FIRST_SECTOR);
+	return new (memory()) dos2_dir(*this, DIR_FIRST_SECTOR);
 }
 
 bool dos25::dos2_dir::at_end()
@@ -128,40 +138,27 @@ void dos25::dos2_dir::next()
 	}
 }
 
+// Position is the number of entry in directory.
+
+size_t dos25::dos2_dir::tell()
+{
+	auto per_sector = fs.sector_size() / 16;
+	return (sector - first_sector) * per_sector + pos / 16;
+}
+
+void dos25::dos2_dir::seek(size_t entry)
+{
+	auto per_sector = fs.sector_size() / 16;
+	sector = first_sector + disk::sector_num(entry / per_sector);
+	pos = (entry % per_sector) * 16;
+	file_no = int(entry) + 1;
+	fs.read_sector(sector, buf);
+}
+
 std::string dos25::dos2_dir::name()
 {
-	char t[4*24];
-	bool inverse = false;
-	size_t p = 0, non_space = 0;
-	for (size_t i = 5; i < 16; i++) {
-		if (i == 5 + 8 && !inverse) {
-			p = non_space;
-			t[p++] = '.';
-		}
-		byte b = buf[pos + i];
-		if (b >= 128) {
-			if (!inverse) {
-				inverse = true;
-				t[p++] = '\\'; t[p++] = 'i';
-			}
-			b = b & 0x7f;
-		} else {
-			if (inverse) {
-				t[p++] = '\\'; t[p++] = 'i';
-				inverse = false;
-			}
-		}
-		if (b < 32 || b == 123 || b >= 125) {
-			const char * hex_digit = "0123456789ABCDEF";
-			t[p++] = '\\'; t[p++] = 'x'; t[p++] = hex_digit[b >> 4]; t[p++] = hex_digit[b & 0xf];
-		} else {
-			if (b == ' ' || b == '\\') t[p++] = '\\';
-			char c = char(b);
-			t[p++] = c;
-		}
-		if (b != ' ' || inverse) non_space = p;
-	}
-	t[non_space] = 0;
+	char t[atascii_name_size(11)];
+	atascii_decode_name(buf + pos + 5, 11, 8, t);
 	return string(t);
 }
 
@@ -175,9 +172,34 @@ size_t dos25::dos2_dir::size()
 	return sec_size() * 125;
 }
 
+void dos25::dos2_dir::snapshot(std::vector<entry> & entries)
+{
+	auto sec_size = fs.sector_size();
+	for (; sector < end_sector; sector++, pos = 0) {
+		auto s = fs.get_sector(sector);
+		for (; pos < sec_size; pos += 16) {
+			byte flags = s.peek(pos);
+			if (flags == FLAG_NEVER_USED) {
+				sector = end_sector;
+				return;
+			}
+			entry e;
+			set_entry_name(e, s.buf + pos + 5, 11, 8);
+			e.flags = flags;
+			e.is_dir = false;
+			e.is_deleted = (flags & FLAG_DELETED) != 0;
+			e.first_sector = s.dpeek(pos + 3);
+			e.sec_size = s.dpeek(pos + 1);
+			e.size = e.sec_size * 125;
+			e.pos = tell();
+			entries.push_back(e);
+		}
+	}
+}
+
 filesystem::file * dos25::dos2_dir::open_file()
 {
-	return new dos2_file(fs, sector, pos, file_no, peek_word(buf, pos + 3), sec_size(), false);
+	return new (fs.memory()) dos2_file(fs, sector, pos, file_no, peek_word(buf, pos + 3), sec_size(), false);
 }
 
 dos25::dos2_file::dos2_file(dos25 & fs, disk::sector_num dir_sector, size_t dir_pos, int file_no, disk::sector_num first_sec, disk::sector_num sec_cnt, bool writing) :
@@ -186,11 +208,13 @@ dos25::dos2_file::dos2_file(dos25 & fs, disk::sector_num dir_sector, size_t dir_
 	dir_pos(dir_pos), 
 	first_sec(first_sec), 
 	sec_cnt(sec_cnt), 
-	writing(writing) 
+	writing(writing),
+	data_map(fs.memory())
 {
-	buf = new byte[fs.d->sector_size()];
+	buf = arena_buffer(fs.memory(), fs.d->sector_size());
 	pos = 0;
 	sector = 0;
+	followed = 0;
 	size = 0;
 	created_by_dos2 = true;
 	if (!writing) {
@@ -202,7 +226,8 @@ dos25::dos2_file::dos2_file(dos25 & fs, disk::sector_num dir_sector, size_t dir_
 int dos25::dos2_dir::alloc_entry(char * name, byte flags, disk::sector_num first_sec, disk::sector_num * p_sector, size_t * p_offset)
 {
 	int file_no = 0;
-	auto dir_buf = new byte[fs.sector_size()];
+	arena_buffer dir_buf(fs.memory(), fs.sector_size());
+	fs.dir_changed();
 	
 	for (auto sec = first_sector; sec < end_sector; sec++) {
 		fs.read_sector(sec, dir_buf);
@@ -219,7 +244,6 @@ int dos25::dos2_dir::alloc_entry(char * name, byte flags, disk::sector_num first
 				//dir_buf[i + 4] = 0;
 				memcpy(dir_buf + i + 5, name, 11);
 				fs.write_sector(sec, dir_buf);
-				delete[] dir_buf;
 				*p_sector = sec;
 				*p_offset = i;
 				return file_no;
@@ -227,7 +251,6 @@ int dos25::dos2_dir::alloc_entry(char * name, byte flags, disk::sector_num first
 			file_no++;
 		}
 	}
-	delete[] dir_buf;
 	throw "dir full";
 }
 
@@ -236,7 +259,7 @@ filesystem::file * dos25::dos2_dir::create_file(char * name)
 	disk::sector_num sector;
 	size_t offset;
 	auto file_no = alloc_entry(name, FLAG_IN_USE | FLAG_OPENED, 0, &sector, &offset);
-	return new dos2_file(fs, sector, offset, file_no, 0, 0, true);
+	return new (fs.memory()) dos2_file(fs, sector, offset, file_no, 0, 0, true);
 }
 
 dos25::dos2_file::~dos2_file()
@@ -275,7 +298,7 @@ void dos25::dos2_file::write_sec(disk::sector_num next)
 
 bool dos25::dos2_file::sector_end()
 {
-	return pos == buf[fs.sector_size() - 1];
+	return pos >= std::min<size_t>(buf[fs.sector_size() - 1], fs.sector_size() - 3);
 }
 
 disk::sector_num dos25::dos2_file::sector_next()
@@ -293,6 +316,7 @@ bool dos25::dos2_file::next_sector()
 {
 	disk::sector_num next = sector_next();
 	if (next == 0) return false;
+	if (++followed >= fs.sector_count()) throw "invalid sector chain";
 
 	sector = next;
 	pos = 0;
@@ -300,25 +324,33 @@ bool dos25::dos2_file::next_sector()
 	return true;
 }
 
-bool dos25::dos2_file::eof()
+// Sector chain is followed once, then any part of file is read directly.
+
+size_t dos25::dos2_file::pread(size_t offset, byte * data, size_t size)
 {
-	do {
-		if (!sector_end()) return false;
-	} while (next_sector());	
-	return true;
+	if (data_map.empty()) {
+		fs.chain->map(*fs.d, first_sec, 3, data_map);
+	}
+	return fs.read_extents(data_map, offset, data, size);
 }
 
-byte dos25::dos2_file::read()
+size_t dos25::dos2_file::size_hint()
 {
-	while (sector_end()) {
-		if (!next_sector())
-			throw("EOF");
-	}
+	return fs.chain->size(*fs.d, first_sec, 3);
+}
 
-	return buf[pos++];
+// Reads go directly to the disk, the buffer is then loaded with the current sector.
+// Writes fill the data area in the buffer.
+
+size_t dos25::dos2_file::read_span(byte * data, size_t size)
+{
+	auto start = sector;
+	auto n = fs.chain->read(*fs.d, sector, pos, followed, 3, data, size);
+	if (sector != start) fs.read_sector(sector, buf);
+	return n;
 }
 
-void dos25::dos2_file::write(byte b) 
+size_t dos25::dos2_file::write_span(const byte * data, size_t size)
 {
 	if (pos == fs.sector_size() - 3) {
 		auto sec = fs.alloc_sector();
@@ -329,12 +361,20 @@ void dos25::dos2_file::write(byte b)
 		}
 		write_sec(sec);
 	}
+	auto n = fs.chain->fill(*fs.d, buf, pos, data, size);
+	this->size += n;
+	return n;
+}
 
-	buf[pos] = b;
-	pos++;
-	size++;
+bool dos25::dos2_file::eof()
+{
+	do {
+		if (!sector_end()) return false;
+	} while (next_sector());	
+	return true;
 }
 
+
 /*
 Volume table of contents(VTOC)
 
@@ -478,6 +518,17 @@ disk::sector_num dos25::free_sector_count()
 	return cnt;
 }
 
+disk::sector_num dos25::file_sectors(size_t size)
+{
+	auto data = sector_size() - 3;
+	return (size + data - 1) / data;
+}
+
+size_t dos25::dir_capacity(bool root)
+{
+	return DIR_SIZE * 8;
+}
+
 disk::sector_num dos25::get_dos_first_sector() 
 { 
 	return read_word(1, BOOT_FILE_LO, BOOT_FILE_HI);
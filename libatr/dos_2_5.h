@@ -35,6 +35,8 @@ Initial free sectors written there is .
 #pragma once
 
 #include "filesystem.h"
+#include "file_io.h"
+#include "dos2_chain.h"
 
 class dos25 : public filesystem
 {
@@ -49,29 +51,36 @@ public:
 	std::string name() override;
 
 	const property * properties() override;
+	static const property * property_table();
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
 
 	disk::sector_num free_sector_count() override;
+	disk::sector_num file_sectors(size_t size) override;
+	size_t dir_capacity(bool root) override;
 
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
 
-	class dos2_file : public filesystem::file
+	class dos2_file : public file_io<dos2_file>
 	{
+		friend class file_io<dos2_file>;
 	public:
 
 		dos2_file(dos25 & fs, disk::sector_num dir_sector, size_t dir_pos, int file_no, disk::sector_num first_sec, disk::sector_num sec_cnt, bool writing);
 		~dos2_file();
 
 		bool eof() override;
-		byte read() override;
-		void write(byte b) override;
+		size_t pread(size_t offset, byte * data, size_t size) override;
+		size_t size_hint() override;
 		disk::sector_num first_sector() override;
 
 	protected:
 
+		size_t read_span(byte * data, size_t size);
+		size_t write_span(const byte * data, size_t size);
+
 		void write_sec(disk::sector_num next);
 		bool sector_end();
 		disk::sector_num sector_next();
@@ -82,7 +91,8 @@ public:
 		// current position
 		disk::sector_num sector;
 		size_t pos;
-		byte * buf;
+		disk::sector_num followed;		// sectors of the chain passed, bounds reading of cyclic chains
+		arena_buffer buf;
 
 		bool writing;
 
@@ -97,6 +107,8 @@ public:
 		size_t size;					// size in bytes
 
 		bool   created_by_dos2;
+
+		arena_vector<filesystem::data_extent> data_map;	// data of every sector in chain, for pread
 	};
 
 	class dos2_dir : public filesystem::dir
@@ -111,6 +123,9 @@ public:
 		size_t size() override;
 		bool is_deleted() override;
 		file * create_file(char * name) override;
+		size_t tell() override;
+		void seek(size_t pos) override;
+		void snapshot(std::vector<entry> & entries) override;
 		void format();
 
 	protected:
@@ -122,7 +137,7 @@ public:
 		size_t           pos;		// position in sector
 		int				 file_no;
 
-		byte * buf;
+		arena_buffer buf;
 	};
 
 	filesystem::dir * root_dir() override;
@@ -150,6 +165,8 @@ protected:
 	disk::sector_num vtoc_sec1;
 	disk::sector_num vtoc_sec2;
 	size_t vtoc_size;
-	byte * vtoc_buf;
+	arena_buffer vtoc_buf;
 	bool vtoc_dirty;
+
+	const dos2_chain_ops * chain;			// sector chain code for the sector size of the disk
 };
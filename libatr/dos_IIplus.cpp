@@ -8,15 +8,15 @@ std::string dos_IIplus::name()
 	return "II+";
 }
 
-bool dos_IIplus::detect(disk * d)
+int dos_IIplus::detect(const detect_info & info)
 {
-	auto s = d->get_sector(1);
-	return s->buf[0] == 0xc4 && s->buf[yBOOT_FILE_LO - 1] == 0xA0 && s->buf[yBOOT_FILE_HI - 1] == 0xA9;
+	auto b = info.boot;
+	return (b[0] == 0xc4 && b[yBOOT_FILE_LO - 1] == 0xA0 && b[yBOOT_FILE_HI - 1] == 0xA9) ? detect_certain : detect_none;
 }
 
 filesystem * dos_IIplus::format(disk * d)
 {
-	dos_IIplus * fs = new dos_IIplus(d);
+	dos_IIplus * fs = new (d->memory()) dos_IIplus(d);
 	fs->vtoc_format(1023, true);
 	return fs;
 }
@@ -31,7 +31,7 @@ disk::sector_num dos_IIplus::get_dos_first_sector()
 	return read_word(1, yBOOT_FILE_LO, yBOOT_FILE_HI);
 }
 
-const filesystem::property * dos_IIplus::properties()
+const filesystem::property * dos_IIplus::property_table()
 {
 	static const filesystem::property props[] = {
 
@@ -50,6 +50,11 @@ const filesystem::property * dos_IIplus::properties()
 	return props;
 }
 
+const filesystem::property * dos_IIplus::properties()
+{
+	return property_table();
+}
+
 dos_IIplus::dos_IIplus(disk * d) : expanded_vtoc(d,true,true)
 {
 }
@@ -46,18 +46,18 @@ void expanded_vtoc::switch_sector_use(disk::sector_num sec, byte count)
 
 		auto off = vtoc_bitmap + num / 8;
 		auto bit = 128 >> (num & 7);
-		auto n = vtoc->peek(off);
+		auto n = vtoc.peek(off);
 		n ^= bit;
-		vtoc->poke(off, n);
+		vtoc.poke(off, n);
 
 		vtoc = get_sector(VTOC_SECTOR);
-		int free = vtoc->dpeek(VTOC_FREE_SEC);
+		int free = vtoc.dpeek(VTOC_FREE_SEC);
 		if (n & bit) {
 			free++;
 		} else {
 			free--;
 		}
-		vtoc->dpoke(VTOC_FREE_SEC, free);
+		vtoc.dpoke(VTOC_FREE_SEC, free);
 
 		sec++;
 	} while (--count > 0);
@@ -86,10 +86,10 @@ void expanded_vtoc::vtoc_format(disk::sector_num max_disk_size, bool reserve_720
 
 		if (vtoc_size == 0) {
 			//byte vers = (disk_size > 720) ? version : 2;
-			//s->poke(VTOC_VERSION, vers);
-			//s->dpoke(VTOC_CAPACITY, size);
-			s->dpoke(VTOC_FREE_SEC, size);
-			s->poke(VTOC_BITMAP, 0x0f);		// first 4 sectors are used by boot	
+			//s.poke(VTOC_VERSION, vers);
+			//s.dpoke(VTOC_CAPACITY, size);
+			s.dpoke(VTOC_FREE_SEC, size);
+			s.poke(VTOC_BITMAP, 0x0f);		// first 4 sectors are used by boot	
 			head = VTOC_BITMAP + 1;
 			size -= 4;						// we manage first 4 sectors 'by hand'
 		}
@@ -100,10 +100,10 @@ void expanded_vtoc::vtoc_format(disk::sector_num max_disk_size, bool reserve_720
 		}
 
 		size_t bytes = x / 8;
-		s->set(head, bytes, 0xff);
+		s.set(head, bytes, 0xff);
 
 		if (auto r = x % 8) {
-			s->poke(head + bytes, rest[r]);
+			s.poke(head + bytes, rest[r]);
 		}
 		vtoc_size++;
 		size -= x;
@@ -0,0 +1,57 @@
+/*
+Bulk file I/O
+
+Concrete file classes derive from file_io<F> (F is the class itself) and implement two non-virtual operations:
+
+	size_t read_span(byte * data, size_t size);			// read up to size bytes, 0 only at the end of file
+	size_t write_span(const byte * data, size_t size);	// write 1 to size bytes, typically up to the end of sector or cluster
+
+read_bytes, write_bytes, read and write are implemented here by loops over the spans. Spans are resolved at compile time
+and inlined into the loops, so copying a chunk of file (save, import, directory entries) costs a single virtual call
+instead of one per byte.
+*/
+
+#pragma once
+
+#include "filesystem.h"
+
+template <class F> class file_io : public filesystem::file
+{
+public:
+	using filesystem::file::read;
+
+	size_t read_bytes(byte * data, size_t size) override
+	{
+		size_t done = 0;
+		while (done < size) {
+			auto n = self().read_span(data + done, size - done);
+			if (n == 0) break;
+			done += n;
+		}
+		return done;
+	}
+
+	void write_bytes(const byte * data, size_t size) override
+	{
+		while (size > 0) {
+			auto n = self().write_span(data, size);
+			data += n;
+			size -= n;
+		}
+	}
+
+	byte read() override
+	{
+		byte b;
+		if (self().read_span(&b, 1) == 0) throw("EOF");
+		return b;
+	}
+
+	void write(byte b) override
+	{
+		self().write_span(&b, 1);
+	}
+
+private:
+	F & self() { return static_cast<F &>(*this); }
+};
@@ -1,6 +1,9 @@
 #include "filesystem.h"
+#include "host_writer.h"
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <algorithm>
 
 using namespace std;
 
@@ -14,46 +17,126 @@ void filesystem::file::write_bytes(const byte * data, size_t size)
 	while (size--) write(*data++);
 }
 
+size_t filesystem::file::pread(size_t offset, byte * data, size_t size)
+{
+	throw "random access not supported";
+}
+
+size_t filesystem::read_extents(const arena_vector<data_extent> & extents, size_t pos, byte * data, size_t size)
+{
+	auto it = upper_bound(extents.begin(), extents.end(), pos, [](size_t p, const data_extent & e) { return p < e.pos; });
+	if (it == extents.begin()) return 0;
+	--it;
+
+	size_t done = 0;
+	for (; it != extents.end() && done < size; ++it) {
+		auto offset = pos + done - it->pos;
+		if (offset >= it->size) break;
+		auto n = min(size - done, it->size - offset);
+		if (it->sector) {
+			memcpy(data + done, d->sector_ptr(it->sector) + offset, n);
+		} else {
+			memset(data + done, 0, n);
+		}
+		done += n;
+	}
+	return done;
+}
+
 void filesystem::file::read(byte * data, size_t size)
 {
-	while (size--) *data++ = read();
+	if (read_bytes(data, size) < size) throw("EOF");
 }
 
-void filesystem::file::save(const string & filename)
+size_t filesystem::file::read_bytes(byte * data, size_t size)
 {
-	ofstream o(filename, ios::binary);
-	while (!eof()) {
-		char c = read();
-		o << c;
+	size_t n = 0;
+	while (n < size && !eof()) data[n++] = read();
+	return n;
+}
+
+// Binary data are read directly into the buffer of the writer.
+
+void filesystem::file::save(const string & filename, bool text)
+{
+	if (!text) {
+		host_writer o(filename, size_hint());
+		while (auto n = read_bytes(o.buffer(), o.available())) o.commit(n);
+		o.close();
+		return;
+	}
+
+	host_writer o(filename);
+	byte buf[16384];
+	vector<char> utf8(3 * sizeof(buf));
+	while (auto n = read_bytes(buf, sizeof(buf))) {
+		o.write(utf8.data(), atascii_to_utf8(buf, n, utf8.data()));
 	}
+	o.close();
 }
 
-void filesystem::file::import(const string & filename)
+void filesystem::file::import(const string & filename, bool text)
 {
 	ifstream o(filename, ios::binary);
 	if (!o.is_open()) throw "file does not exist";
-	byte c;
-	size_t len = 0;
-	while (o.read((char *)&c, 1)) {
-		if (len == 640) {
-			len = 640;
+	char buf[16384 + 4];		// room for UTF-8 character split between reads
+	byte out[sizeof(buf)];
+	size_t keep = 0;
+	while (o.read(buf + keep, 16384) || o.gcount() > 0) {
+		auto n = keep + size_t(o.gcount());
+		if (text) {
+			size_t used;
+			write_bytes(out, utf8_to_atascii(buf, n, out, &used));
+			keep = n - used;
+			memmove(buf, buf + used, keep);
+		} else {
+			write_bytes((byte *)buf, n);
 		}
-		write(c);
-		len++;
+	}
+	if (keep) throw "invalid UTF-8 text";
+}
+
+void filesystem::file::import(const byte * data, size_t size, bool text)
+{
+	if (!text) {
+		write_bytes(data, size);
+		return;
+	}
+	byte out[16384];
+	while (size > 0) {
+		size_t used;
+		write_bytes(out, utf8_to_atascii((const char *)data, min(size, sizeof(out)), out, &used));
+		if (used == 0) throw "invalid UTF-8 text";
+		data += used;
+		size -= used;
 	}
 }
 
 const filesystem::property * filesystem::find_property(const std::string & name)
 {
-	
-	for (auto p = properties(); p->name; p++) {
-		if (name == p->name) return p;
+	return find_property(properties(), name.c_str(), name.size());
+}
+
+const filesystem::property * filesystem::find_property(const property * props, const char * name, size_t len)
+{
+	for (auto p = props; p->name; p++) {
+		if (strncmp(p->name, name, len) == 0 && p->name[len] == 0) return p;
 	}
 	return nullptr;
 }
 
 void filesystem::set_property(const property * prop, const string & value)
 {
+	if (prop->size > 2) {
+		// Text is separated from property name by one space and padded with spaces
+		auto s = get_sector(prop->sector);
+		size_t start = (!value.empty() && value[0] == ' ') ? 1 : 0;
+		for (size_t i = 0; i < prop->size; i++) {
+			s.poke(prop->offset + i, (start + i < value.size()) ? byte(value[start + i]) : ' ');
+		}
+		return;
+	}
+
 	auto t = value.c_str();
 
 	while (*t == ' ') t++;
@@ -71,10 +154,10 @@ void filesystem::set_property(const property * prop, int value)
 {
 	auto s = get_sector(prop->sector);
 	if (prop->size == 1) {
-		s->poke(prop->offset, value);
-		s->buf[prop->offset] = value;
+		s.poke(prop->offset, value);
+		s.buf[prop->offset] = value;
 	} else if (prop->size == 2) {
-		poke_word(s->buf, prop->offset, value);
+		poke_word(s.buf, prop->offset, value);
 	}
 }
 
@@ -132,53 +215,21 @@ string filesystem::get_property(const property * prop)
 	return string(txt);
 }
 
-bool filesystem::format_atari_name(istream & s, char * name, size_t name_len, size_t ext_len)
-/*
-Atari filename format
-
-\i   turn inversion on / off
-\xhh hex char
-\    space
-\\   backslash
-*/ {
-	bool inverse = false;
-	auto len = name_len + ext_len;
-
-	for (size_t i = 0; i < len; i++) name[i] = ' ';
-	name[len] = 0;
-	size_t i = 0;
-	char c;
-	bool atascii = false;
-
-	while (s.get(c)) {
-		if (c == ' ') {
-			if (i == 0) continue;
-			else break;
-		}
-		if (c == '\\') {
-			s.get(c);
-			switch (c) {
-			case 'i':
-				inverse = !inverse;
-				continue;
-			case 'x':
-				char h[3];
-				s.get(h, 3);
-				c = std::stoi(h, nullptr, 16);
-				atascii = true;
-				break;
-			}
-		} else if (c == '.' && i <= name_len) {
-			i = name_len;
-			continue;
-		}
-		if (i > len) {
-			throw "filename too long";
-		}
-		name[i] = c | (inverse ? 128 : 0);
-		i++;
+void filesystem::set_entry_name(entry & e, const byte * name, size_t len, size_t ext_pos)
+{
+	e.raw_len = min(len, size_t(entry::max_name));
+	e.ext_pos = min(ext_pos, e.raw_len);
+	memcpy(e.raw_name, name, e.raw_len);
+}
+
+vector<filesystem::entry> filesystem::snapshot_dir(dir * d)
+{
+	vector<entry> entries;
+	d->snapshot(entries);
+	for (auto & e : entries) {
+		atascii_decode_name(e.raw_name, e.raw_len, e.ext_pos, e.name);
 	}
-	return i > 0;
+	return entries;
 }
 
 filesystem::dir * filesystem::dir::open_dir()
@@ -206,6 +257,21 @@ disk::sector_num filesystem::free_sector_count()
 	return 0;
 }
 
+disk::sector_num filesystem::file_sectors(size_t size)
+{
+	return (size + sector_size() - 1) / sector_size();
+}
+
+size_t filesystem::dir_entry_bytes(const char * name)
+{
+	return 0;
+}
+
+disk::sector_num filesystem::dir_sectors(size_t bytes, bool root)
+{
+	return 0;
+}
+
 filesystem::file * filesystem::dir::create_file(char * name)
 {
 	throw "file creating not supported";
@@ -215,3 +281,49 @@ filesystem::dir * filesystem::dir::create_dir(char * name)
 {
 	throw "dirs not supported";
 }
+
+filesystem::dir * filesystem::lookup(const std::string & full_path)
+{
+	auto last = full_path.find_last_not_of('/');
+	if (last == string::npos) return nullptr;
+	auto path = full_path.substr(0, last + 1);
+
+	unique_ptr<dir> dr(root_dir());
+	string dir_path;
+	size_t start = 0;
+
+	for (;;) {
+		auto end = path.find('/', start);
+		auto name = path.substr(start, end == string::npos ? string::npos : end - start);
+		start = end + 1;
+
+		if (name.empty()) continue;
+
+		size_t pos;
+		{
+			lock_guard<mutex> lock(lookup_mutex);
+			auto it = lookup_index.find(dir_path);
+			if (it == lookup_index.end()) {
+				auto & index = lookup_index[dir_path];
+				for (auto & e : snapshot_dir(dr.get())) {
+					if (!e.is_deleted) {
+						index.emplace(e.name, e.pos);		// first entry wins, as in DOS
+					}
+				}
+				it = lookup_index.find(dir_path);
+			}
+
+			auto entry = it->second.find(name);
+			if (entry == it->second.end()) return nullptr;
+			pos = entry->second;
+		}
+		dr->seek(pos);
+
+		if (end == string::npos) return dr.release();
+		if (!dr->is_dir()) return nullptr;
+
+		dr.reset(dr->open_dir());
+		dir_path += name;
+		dir_path += '/';
+	}
+}
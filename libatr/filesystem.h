@@ -1,9 +1,13 @@
 #pragma once
 #include "disk.h"
+#include "atascii.h"
 #include <string>
 #include <istream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
-class filesystem
+class filesystem : public arena_object
 {
 public:
 	filesystem(disk * d) : d(d) {}
@@ -20,7 +24,26 @@ public:
 
 	virtual const property * properties() = 0;
 
+	// Sectors examined by filesystem detection. They are read once and passed to every detector,
+	// which returns confidence that the disk uses its filesystem.
+
+	struct detect_info
+	{
+		disk * d;
+		const byte * boot;		// sector 1
+		const byte * vtoc;		// sector 360, nullptr if the disk is smaller
+	};
+
+	enum detect_confidence
+	{
+		detect_none     = 0,
+		detect_fallback = 10,		// no signature, used when nothing else matches
+		detect_likely   = 75,		// single byte signature or VTOC check
+		detect_certain  = 100		// multi byte signature
+	};
+
 	const property * find_property(const std::string & name);
+	static const property * find_property(const property * props, const char * name, size_t len);
 	void set_property(const property * prop, const std::string & value);
 	void set_property(const property * prop, int value);
 
@@ -36,24 +59,61 @@ public:
 
 	virtual disk::sector_num free_sector_count();
 
+	// Capacity planning (used to check that files fit on the disk before they are written).
+	// Sectors are counted as allocated on freshly formatted disk, where it depends on fragmentation it is the minimum.
+
+	virtual disk::sector_num file_sectors(size_t size);					// sectors allocated for file of given size
+	virtual size_t dir_entry_bytes(const char * name);					// size of directory entry for Atari name (8.3)
+	virtual disk::sector_num dir_sectors(size_t bytes, bool root);		// sectors for directory entries, beyond those allocated by format
+	virtual size_t dir_capacity(bool root) { return 0; }				// maximal number of entries, 0 if unlimited
+
 	virtual disk::sector_num get_dos_first_sector() { return 0; }
 	virtual void set_dos_first_sector(disk::sector_num sector) {}
 
-	class file
+	// Install boot sectors from file. Filesystems keeping their layout in boot sector preserve it.
+	virtual void install_boot(const std::string & filename) { d->install_boot(filename); }
+
+	class file : public arena_object
 	{
 	public:
 		virtual bool eof() = 0;
 		virtual byte read() = 0;
 		virtual void write(byte b) = 0;
 		void read(byte * data, size_t size);
+		virtual size_t read_bytes(byte * data, size_t size);		// returns number of bytes read, less than size at the end of file
 		virtual void write_bytes(const byte * data, size_t size);
-		void save(const std::string & filename);
-		void import(const std::string & filename);
+
+		// Read data at specified position without changing current position of the file (only for files opened for reading).
+		// Returns number of bytes read, less than size at the end of file.
+		virtual size_t pread(size_t offset, byte * data, size_t size);
+		virtual size_t size_hint() { return 0; }	// size in bytes for reserving space on the host, 0 if not known
+		void save(const std::string & filename, bool text = false);		// text: convert ATASCII to UTF-8
+		void import(const std::string & filename, bool text = false);	// text: convert UTF-8 to ATASCII
+		void import(const byte * data, size_t size, bool text = false);	// contents of host file already in memory
 		virtual ~file() {};
 		virtual disk::sector_num first_sector() = 0;
 	};
 
-	class dir
+	// Directory entry decoded by snapshot_dir
+
+	struct entry
+	{
+		enum { max_name = 32 };
+
+		byte   raw_name[max_name];		// name as stored on disk
+		size_t raw_len;
+		size_t ext_pos;					// position of extension in raw name, raw_len if there is none
+		char   name[atascii_name_size(max_name)];	// printable name
+		byte   flags;					// filesystem specific flags
+		bool   is_dir;
+		bool   is_deleted;
+		disk::sector_num first_sector;
+		size_t sec_size;				// size in sectors
+		size_t size;					// size in bytes
+		size_t pos;						// position of entry in directory, see dir::seek
+	};
+
+	class dir : public arena_object
 	{
 	public:
 		virtual ~dir();
@@ -68,12 +128,30 @@ public:
 		virtual bool  is_deleted();
 		virtual file * create_file(char * name);
 		virtual dir * create_dir(char * name);
+
+		// Position of current entry in the directory. Seeking to it makes the entry current again.
+		virtual size_t tell() = 0;
+		virtual void seek(size_t pos) = 0;
+
+		// Add all entries from current position to the end of directory, only raw names are filled.
+		virtual void snapshot(std::vector<entry> & entries) = 0;
 	};
 
+	// Decode directory from current position, names of all entries are converted at once.
+	std::vector<entry> snapshot_dir(dir * d);
+
 	disk * get_disk();
+	arena & memory() { return d->memory(); }		// dir and file objects are allocated here
 	//virtual file * create_file(char * name) = 0;
 	virtual dir * root_dir() = 0;
 
+	// Find file or directory by path, with names separated by '/' as printed by list.
+	// Returns directory positioned at the entry (use open_file, open_dir, size...) or nullptr if there is no such entry.
+	// Names of every visited directory are indexed when it is searched for the first time,
+	// the index is kept by the filesystem, so following lookups in the same directory do not read it again.
+	// The index is locked, so more threads may look up files of the same disk concurrently.
+	dir * lookup(const std::string & path);
+
 	size_t sector_size() {
 		return d->sector_size();
 	}
@@ -82,7 +160,17 @@ public:
 		return d->sector_count();
 	}
 
-	static bool format_atari_name(std::istream & s, char * name, size_t name_len, size_t ext_len);
+	static void set_entry_name(entry & e, const byte * name, size_t len, size_t ext_pos);
+
+	// Placement of file data on disk used for random access to files.
+	// Files build list of extents when pread is called first time, it is then used for all reads.
+
+	struct data_extent
+	{
+		size_t pos;						// position in file
+		size_t size;					// number of bytes stored in consecutive sectors
+		disk::sector_num sector;		// first sector, 0 for data missing on disk (read as zeros)
+	};
 
 protected:
 
@@ -96,10 +184,24 @@ protected:
 		d->read_sector(num, data);
 	}
 
-	disk::sector * get_sector(disk::sector_num num)
+	disk::sector get_sector(disk::sector_num num)
 	{
 		return d->get_sector(num);
 	}
 
+	size_t read_extents(const arena_vector<data_extent> & extents, size_t pos, byte * data, size_t size);
+
+	// Must be called by directories when entry is added, so lookup does not use stale index.
+	void dir_changed()
+	{
+		std::lock_guard<std::mutex> lock(lookup_mutex);
+		lookup_index.clear();
+	}
+
 	disk * d;
+
+private:
+	typedef std::unordered_map<std::string, size_t> dir_index;		// name -> position of entry in directory
+	std::unordered_map<std::string, dir_index> lookup_index;		// directory path -> its index
+	std::mutex lookup_mutex;
 };
@@ -0,0 +1,535 @@
+#include "gzip.h"
+#include <istream>
+#include <ostream>
+#include <limits>
+
+using namespace std;
+
+enum gzip_header
+{
+	gz_id1 = 0,   // 0x1f
+	gz_id2 = 1,   // 0x8b
+	gz_cm = 2,    // compression method (8 = deflate)
+	gz_flg = 3,
+	gz_mtime = 4, // 4 bytes
+	gz_xfl = 8,
+	gz_os = 9,
+	gz_header_size = 10
+};
+
+enum gzip_flags
+{
+	gz_fhcrc = 0x02,
+	gz_fextra = 0x04,
+	gz_fname = 0x08,
+	gz_fcomment = 0x10
+};
+
+static const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const byte     length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const byte     dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+static unsigned reverse_bits(unsigned code, unsigned len)
+{
+	unsigned r = 0;
+	while (len--) {
+		r = (r << 1) | (code & 1);
+		code >>= 1;
+	}
+	return r;
+}
+
+uint32_t crc32(uint32_t crc, const byte * data, size_t size)
+{
+	static const struct crc_table {
+		uint32_t t[256];
+		crc_table() {
+			for (uint32_t n = 0; n < 256; n++) {
+				uint32_t c = n;
+				for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				t[n] = c;
+			}
+		}
+	} table;
+
+	crc = ~crc;
+	while (size--) crc = table.t[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+//===== gzip container
+
+bool detect_gzip(const byte * head, size_t file_size, const std::string & filename)
+{
+	return head[gz_id1] == 0x1f && head[gz_id2] == 0x8b;
+}
+
+disk * load_gzip(std::istream & f, size_t file_size)
+{
+	// Size of uncompressed data (modulo 2^32) is stored at the end of the file.
+
+	auto start = f.tellg();
+	byte isize[4];
+	f.seekg(-4, ios::end);
+	f.read((char *)isize, 4);
+	f.seekg(start);
+	size_t size = isize[0] + (isize[1] << 8) + (isize[2] << 16) + (size_t(isize[3]) << 24);
+
+	byte header[gz_header_size];
+	f.read((char *)header, gz_header_size);
+	if (!f || header[gz_id1] != 0x1f || header[gz_id2] != 0x8b || header[gz_cm] != 8) throw "Invalid gzip header.";
+
+	auto flags = header[gz_flg];
+	if (flags & gz_fextra) {
+		size_t len = f.get();
+		len += f.get() << 8;
+		f.ignore(len);
+	}
+	if (flags & gz_fname) f.ignore(numeric_limits<streamsize>::max(), '\0');
+	if (flags & gz_fcomment) f.ignore(numeric_limits<streamsize>::max(), '\0');
+	if (flags & gz_fhcrc) f.ignore(2);
+
+	inflate_streambuf inflater(f);
+	istream in(&inflater);
+	in.exceptions(ios::badbit);		// errors in compressed data are reported by exceptions from the inflater
+
+	auto d = disk::load(in, size, "");
+
+	// Decode rest of the stream, so the checksum gets verified.
+	try {
+		in.ignore(numeric_limits<streamsize>::max());
+	} catch (...) {
+		delete d;
+		throw;
+	}
+	return d;
+}
+
+void save_gzip(disk & d, std::ostream & f)
+{
+	byte header[gz_header_size];
+	memset(header, 0, gz_header_size);
+	header[gz_id1] = 0x1f;
+	header[gz_id2] = 0x8b;
+	header[gz_cm] = 8;
+	header[gz_os] = 255;		// unknown
+	f.write((char *)header, gz_header_size);
+
+	deflate_streambuf deflater(f);
+	ostream out(&deflater);
+	disk::find_format(".atr")->save(d, out);
+	deflater.finish();
+}
+
+//===== inflate
+
+inflate_streambuf::inflate_streambuf(std::istream & in) : in(in), buf(buffer_size, true), tables(3, false)
+{
+	bit_buf = 0;
+	bit_cnt = 0;
+	block = block_none;
+	final_block = false;
+	done = false;
+	stored_left = 0;
+	out_pos = 0;
+	base = 0;
+	crc = 0;
+	setg((char *)buf.data(), (char *)buf.data(), (char *)buf.data());
+}
+
+byte inflate_streambuf::next_byte()
+{
+	auto c = in.rdbuf()->sbumpc();
+	if (c == traits_type::eof()) throw "gzip data is truncated";
+	return byte(c);
+}
+
+void inflate_streambuf::need(unsigned count)
+{
+	while (bit_cnt < count) {
+		bit_buf |= uint64_t(next_byte()) << bit_cnt;
+		bit_cnt += 8;
+	}
+}
+
+unsigned inflate_streambuf::bits(unsigned count)
+{
+	need(count);
+	unsigned v = unsigned(bit_buf & ((1u << count) - 1));
+	bit_buf >>= count;
+	bit_cnt -= count;
+	return v;
+}
+
+void inflate_streambuf::build(huffman & h, const byte * lengths, unsigned count)
+{
+	unsigned bl_count[max_bits + 1] = { 0 };
+	unsigned next_code[max_bits + 1];
+
+	h.bits = 0;
+	for (unsigned i = 0; i < count; i++) {
+		bl_count[lengths[i]]++;
+		if (lengths[i] > h.bits) h.bits = lengths[i];
+	}
+	bl_count[0] = 0;
+
+	unsigned code = 0;
+	for (unsigned len = 1; len <= max_bits; len++) {
+		code = (code + bl_count[len - 1]) << 1;
+		next_code[len] = code;
+	}
+
+	if (h.bits == 0) h.bits = 1;		// empty distance tree (literals only)
+	memset(h.table, 0, sizeof(h.table[0]) << h.bits);
+
+	for (unsigned sym = 0; sym < count; sym++) {
+		unsigned len = lengths[sym];
+		if (len == 0) continue;
+		unsigned rev = reverse_bits(next_code[len]++, len);
+		for (unsigned i = rev; i < (1u << h.bits); i += 1u << len) {
+			h.table[i] = uint16_t((sym << 4) | len);
+		}
+	}
+}
+
+unsigned inflate_streambuf::decode(const huffman & h)
+{
+	// Codes are shorter than h.bits near the end of the stream, so we must not request more bits than available.
+	while (bit_cnt < h.bits) {
+		auto c = in.rdbuf()->sbumpc();
+		if (c == traits_type::eof()) break;
+		bit_buf |= uint64_t(byte(c)) << bit_cnt;
+		bit_cnt += 8;
+	}
+	auto e = h.table[bit_buf & ((1u << h.bits) - 1)];
+	unsigned len = e & 15;
+	if (e == 0 || len > bit_cnt) throw "Invalid gzip data.";
+	bit_buf >>= len;
+	bit_cnt -= len;
+	return e >> 4;
+}
+
+void inflate_streambuf::read_dynamic_tables()
+{
+	static const byte order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	unsigned hlit = bits(5) + 257;
+	unsigned hdist = bits(5) + 1;
+	unsigned hclen = bits(4) + 4;
+
+	byte lengths[286 + 32];
+	memset(lengths, 0, sizeof(lengths));
+	for (unsigned i = 0; i < hclen; i++) lengths[order[i]] = byte(bits(3));
+	build(tables[2], lengths, 19);
+
+	memset(lengths, 0, sizeof(lengths));
+	for (unsigned n = 0; n < hlit + hdist; ) {
+		unsigned sym = decode(tables[2]);
+		unsigned rep;
+		byte val = 0;
+		if (sym < 16) {
+			lengths[n++] = byte(sym);
+			continue;
+		} else if (sym == 16) {
+			if (n == 0) throw "Invalid gzip data.";
+			val = lengths[n - 1];
+			rep = 3 + bits(2);
+		} else if (sym == 17) {
+			rep = 3 + bits(3);
+		} else {
+			rep = 11 + bits(7);
+		}
+		if (n + rep > hlit + hdist) throw "Invalid gzip data.";
+		while (rep--) lengths[n++] = val;
+	}
+
+	build(tables[0], lengths, hlit);
+	build(tables[1], lengths + hlit, hdist);
+}
+
+void inflate_streambuf::read_block_header()
+{
+	final_block = bits(1) != 0;
+	switch (bits(2)) {
+	case 0: {
+		bits(bit_cnt & 7);		// stored block starts on byte boundary
+		unsigned len = bits(16);
+		unsigned nlen = bits(16);
+		if ((len ^ 0xffff) != nlen) throw "Invalid gzip data.";
+		stored_left = len;
+		block = block_stored;
+		break;
+	}
+	case 1: {
+		byte lengths[288 + 32];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 256 - 144);
+		memset(lengths + 256, 7, 280 - 256);
+		memset(lengths + 280, 8, 288 - 280);
+		memset(lengths + 288, 5, 32);
+		build(tables[0], lengths, 288);
+		build(tables[1], lengths + 288, 32);
+		block = block_huffman;
+		break;
+	}
+	case 2:
+		read_dynamic_tables();
+		block = block_huffman;
+		break;
+	default:
+		throw "Invalid gzip data.";
+	}
+}
+
+void inflate_streambuf::read_trailer()
+{
+	bits(bit_cnt & 7);
+	uint32_t stored_crc = bits(16);
+	stored_crc |= uint32_t(bits(16)) << 16;
+	uint32_t isize = bits(16);
+	isize |= uint32_t(bits(16)) << 16;
+
+	if (stored_crc != crc || isize != uint32_t(base + out_pos)) throw "gzip checksum does not match.";
+}
+
+void inflate_streambuf::inflate()
+/*
+Purpose:
+	Decode next part of the stream into the buffer.
+	Last window_size bytes are kept in the buffer as history for back references.
+*/
+{
+	if (out_pos + max_match > buffer_size) {
+		memmove(buf.data(), buf.data() + out_pos - window_size, window_size);
+		base += out_pos - window_size;
+		out_pos = window_size;
+	}
+
+	auto start = out_pos;
+	byte * out = buf.data();
+
+	while (out_pos + max_match <= buffer_size && !done) {
+
+		if (block == block_none) {
+			if (final_block) {
+				done = true;
+				break;
+			}
+			read_block_header();
+
+		} else if (block == block_stored) {
+			auto n = min(stored_left, buffer_size - out_pos);
+			stored_left -= n;
+			while (n > 0 && bit_cnt >= 8) {
+				out[out_pos++] = byte(bits(8));
+				n--;
+			}
+			if (in.rdbuf()->sgetn((char *)out + out_pos, n) != streamsize(n)) throw "gzip data is truncated";
+			out_pos += n;
+			if (stored_left == 0) block = block_none;
+
+		} else {
+			unsigned sym = decode(tables[0]);
+			if (sym < 256) {
+				out[out_pos++] = byte(sym);
+			} else if (sym == 256) {
+				block = block_none;
+			} else {
+				sym -= 257;
+				if (sym >= 29) throw "Invalid gzip data.";
+				size_t len = length_base[sym] + bits(length_extra[sym]);
+				unsigned dsym = decode(tables[1]);
+				if (dsym >= 30) throw "Invalid gzip data.";
+				size_t dist = dist_base[dsym] + bits(dist_extra[dsym]);
+				if (dist > out_pos) throw "Invalid gzip data.";
+
+				// Source and destination may overlap, so the copy must go byte by byte.
+				byte * src = out + out_pos - dist;
+				byte * dst = out + out_pos;
+				for (size_t i = 0; i < len; i++) dst[i] = src[i];
+				out_pos += len;
+			}
+		}
+	}
+
+	crc = crc32(crc, out + start, out_pos - start);
+	if (done) read_trailer();
+	setg((char *)out, (char *)out + start, (char *)out + out_pos);
+}
+
+inflate_streambuf::int_type inflate_streambuf::underflow()
+{
+	while (gptr() == egptr() && !done) {
+		inflate();
+	}
+	if (gptr() == egptr()) return traits_type::eof();
+	return traits_type::to_int_type(*gptr());
+}
+
+inflate_streambuf::pos_type inflate_streambuf::seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which)
+{
+	if (dir != ios_base::cur) return pos_type(off_type(-1));
+	return seekpos(pos_type(off_type(base + (gptr() - eback())) + off), which);
+}
+
+inflate_streambuf::pos_type inflate_streambuf::seekpos(pos_type pos, std::ios_base::openmode which)
+/*
+	Only positions inside of the current buffer (including history) are supported.
+*/
+{
+	off_type p = off_type(pos);
+	if (p < off_type(base) || p > off_type(base + out_pos)) return pos_type(off_type(-1));
+	setg(eback(), eback() + (p - base), egptr());
+	return pos;
+}
+
+//===== deflate
+
+deflate_streambuf::deflate_streambuf(std::ostream & out) : out(out), buf(window_size + chunk_size), head(hash_size), prev(window_size + chunk_size)
+{
+	dict = 0;
+	bit_buf = 0;
+	bit_cnt = 0;
+	crc = 0;
+	total = 0;
+	setp((char *)buf.data(), (char *)buf.data() + buf.size());
+}
+
+deflate_streambuf::int_type deflate_streambuf::overflow(int_type c)
+{
+	compress(false);
+	if (c != traits_type::eof()) {
+		*pptr() = char(c);
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+void deflate_streambuf::finish()
+{
+	compress(true);
+	put_bits(crc & 0xffff, 16);
+	put_bits(crc >> 16, 16);
+	put_bits(total & 0xffff, 16);
+	put_bits(total >> 16, 16);
+	out.write((char *)packed.data(), packed.size());
+	packed.clear();
+}
+
+void deflate_streambuf::put_bits(uint32_t value, unsigned count)
+{
+	bit_buf |= uint64_t(value) << bit_cnt;
+	bit_cnt += count;
+	while (bit_cnt >= 8) {
+		packed.push_back(byte(bit_buf));
+		bit_buf >>= 8;
+		bit_cnt -= 8;
+	}
+}
+
+void deflate_streambuf::put_literal(unsigned sym)
+/*
+	Fixed Huffman code of literal/length symbol.
+*/
+{
+	if (sym < 144) {
+		put_bits(reverse_bits(0x30 + sym, 8), 8);
+	} else if (sym < 256) {
+		put_bits(reverse_bits(0x190 + sym - 144, 9), 9);
+	} else if (sym < 280) {
+		put_bits(reverse_bits(sym - 256, 7), 7);
+	} else {
+		put_bits(reverse_bits(0xc0 + sym - 280, 8), 8);
+	}
+}
+
+void deflate_streambuf::put_match(size_t len, size_t dist)
+{
+	unsigned i = 28;
+	while (length_base[i] > len) i--;
+	put_literal(257 + i);
+	put_bits(unsigned(len - length_base[i]), length_extra[i]);
+
+	unsigned j = 29;
+	while (dist_base[j] > dist) j--;
+	put_bits(reverse_bits(j, 5), 5);
+	put_bits(unsigned(dist - dist_base[j]), dist_extra[j]);
+}
+
+void deflate_streambuf::compress(bool last)
+/*
+Purpose:
+	Compress data written to the buffer since the last call as one block with fixed Huffman codes.
+	Data before dict are used as history for matching.
+*/
+{
+	byte * data = buf.data();
+	size_t end = (byte *)pptr() - data;
+
+	auto hash = [data](size_t p) {
+		return ((data[p] << 10) ^ (data[p + 1] << 5) ^ data[p + 2]) & (hash_size - 1);
+	};
+
+	fill(head.begin(), head.end(), -1);
+
+	for (size_t p = 0; p + min_match <= dict; p++) {
+		auto h = hash(p);
+		prev[p] = head[h];
+		head[h] = int32_t(p);
+	}
+
+	put_bits(last ? 1 : 0, 1);
+	put_bits(1, 2);		// fixed Huffman codes
+
+	for (size_t p = dict; p < end; ) {
+		size_t best_len = 0, best_dist = 0;
+
+		if (p + min_match <= end) {
+			size_t max_len = min(size_t(max_match), end - p);
+			auto h = hash(p);
+			int chain = max_chain;
+			for (int32_t cand = head[h]; cand >= 0 && p - cand <= window_size && chain-- > 0; cand = prev[cand]) {
+				size_t len = 0;
+				while (len < max_len && data[cand + len] == data[p + len]) len++;
+				if (len > best_len) {
+					best_len = len;
+					best_dist = p - cand;
+					if (len == max_len) break;
+				}
+			}
+			prev[p] = head[h];
+			head[h] = int32_t(p);
+		}
+
+		if (best_len >= min_match) {
+			put_match(best_len, best_dist);
+			for (size_t i = 1; i < best_len; i++) {
+				if (p + i + min_match <= end) {
+					auto h = hash(p + i);
+					prev[p + i] = head[h];
+					head[h] = int32_t(p + i);
+				}
+			}
+			p += best_len;
+		} else {
+			put_literal(data[p]);
+			p++;
+		}
+	}
+
+	put_literal(256);		// end of block
+
+	if (last && bit_cnt > 0) put_bits(0, 8 - bit_cnt);
+
+	crc = crc32(crc, data + dict, end - dict);
+	total += uint32_t(end - dict);
+
+	out.write((char *)packed.data(), packed.size());
+	packed.clear();
+
+	auto keep = min(end, size_t(window_size));
+	memmove(data, data + end - keep, keep);
+	dict = keep;
+	setp((char *)data + dict, (char *)data + buf.size());
+}
@@ -0,0 +1,118 @@
+/*
+gzip compressed disk images (.atr.gz)
+
+Inflate and deflate are implemented here, so the library does not depend on zlib.
+Compressed data are decoded as a stream, the disk image is read directly from the decompressor window
+into the disk buffer without holding whole uncompressed file in memory.
+
+Compression uses fixed Huffman codes with LZ77 matching, which is good enough for disk images
+(mostly empty sectors and repeating data).
+
+[1] RFC 1951 DEFLATE Compressed Data Format Specification version 1.3
+[2] RFC 1952 GZIP file format specification version 4.3
+*/
+
+#pragma once
+
+#include "disk.h"
+#include "buffer_pool.h"
+#include <streambuf>
+#include <vector>
+
+bool   detect_gzip(const byte * head, size_t file_size, const std::string & filename);
+disk * load_gzip(std::istream & f, size_t file_size);
+void   save_gzip(disk & d, std::ostream & f);
+
+uint32_t crc32(uint32_t crc, const byte * data, size_t size);
+
+class inflate_streambuf : public std::streambuf
+{
+public:
+	inflate_streambuf(std::istream & in);
+
+protected:
+	int_type underflow() override;
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+	enum {
+		window_size = 32768,
+		buffer_size = 4 * window_size,
+		max_match = 258,
+		max_bits = 15
+	};
+
+	struct huffman {
+		uint16_t table[1 << max_bits];		// symbol << 4 | code length, 0 for invalid code
+		unsigned bits;
+	};
+
+	void inflate();
+	void read_block_header();
+	void read_dynamic_tables();
+	void read_trailer();
+
+	void build(huffman & h, const byte * lengths, unsigned count);
+	unsigned decode(const huffman & h);
+
+	void need(unsigned count);
+	unsigned bits(unsigned count);
+	byte next_byte();
+
+	std::istream & in;
+
+	uint64_t bit_buf;
+	unsigned bit_cnt;
+
+	enum { block_none, block_stored, block_huffman } block;
+	bool   final_block;
+	bool   done;
+	size_t stored_left;
+
+	pool_array<byte> buf;		// buffers are reused when many images are loaded
+	size_t out_pos;				// end of decoded data in buffer
+	size_t base;				// stream position of the buffer start
+	uint32_t crc;
+
+	pool_array<huffman> tables;	// literal/length, distance, code lengths
+};
+
+class deflate_streambuf : public std::streambuf
+{
+public:
+	deflate_streambuf(std::ostream & out);
+
+	// Compress pending data and write gzip trailer. Must be called after all data has been written.
+	void finish();
+
+protected:
+	int_type overflow(int_type c) override;
+
+private:
+	enum {
+		window_size = 32768,
+		chunk_size = 65536,
+		hash_size = 1 << 15,
+		max_chain = 32,
+		min_match = 3,
+		max_match = 258
+	};
+
+	void compress(bool last);
+	void put_bits(uint32_t value, unsigned count);
+	void put_literal(unsigned sym);
+	void put_match(size_t len, size_t dist);
+
+	std::ostream & out;
+	std::vector<byte> buf;		// window + chunk
+	size_t dict;				// size of history at the start of buffer
+	std::vector<int32_t> head, prev;
+
+	std::vector<byte> packed;
+	uint64_t bit_buf;
+	unsigned bit_cnt;
+
+	uint32_t crc;
+	uint32_t total;
+};
@@ -0,0 +1,236 @@
+#include "host_writer.h"
+#include "buffer_pool.h"
+#include "sparse_memory.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+	// Continue writing through the page cache, used for the unaligned end of file and when O_DIRECT is refused.
+
+	void end_direct(int fd, bool & direct)
+	{
+#ifdef ATR_DIRECT_IO
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+		direct = false;
+	}
+
+	bool seek_to(int fd, size_t pos)
+	{
+#ifdef _WIN32
+		return _lseeki64(fd, pos, SEEK_SET) >= 0;
+#else
+		return lseek(fd, off_t(pos), SEEK_SET) >= 0;
+#endif
+	}
+
+	bool set_size(int fd, size_t size)
+	{
+#ifdef _WIN32
+		return _chsize_s(fd, size) == 0;
+#else
+		return ftruncate(fd, off_t(size)) == 0;
+#endif
+	}
+}
+
+host_writer::host_writer(const string & filename, size_t size, bool sparse) : fd(-1), direct(false), sparse(sparse), offset(0), capacity(buffer_size), used(0)
+{
+	mem = (byte *)buffer_pool::global().alloc(buffer_size + direct_align, false);
+	buf = (byte *)((uintptr_t(mem) + direct_align - 1) & ~uintptr_t(direct_align - 1));
+
+#ifdef _WIN32
+	fd = _open(filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef ATR_DIRECT_IO
+	if (size >= direct_min) {
+		fd = open(filename.c_str(), flags | O_DIRECT, 0666);
+		direct = fd >= 0;
+	}
+#endif
+	if (fd < 0) fd = open(filename.c_str(), flags, 0666);
+#endif
+	if (fd < 0) {
+		buffer_pool::global().release(mem, buffer_size + direct_align);
+		throw "can not create file";
+	}
+
+#ifdef __linux__
+	// space is only reserved, size of the file is set by the written data; errors are ignored, it is just a hint
+	if (size > 0 && !sparse) fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, off_t(size));
+#endif
+}
+
+host_writer::~host_writer()
+{
+	if (fd >= 0) {
+#ifdef _WIN32
+		_close(fd);
+#else
+		::close(fd);
+#endif
+	}
+	buffer_pool::global().release(mem, buffer_size + direct_align);
+}
+
+void host_writer::write_all(const byte * data, size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+#ifdef _WIN32
+		auto r = _write(fd, data + done, unsigned(n - done));
+#else
+		auto r = ::write(fd, data + done, n - done);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && errno == EINVAL && direct) {
+			end_direct(fd, direct);
+			continue;
+		}
+#endif
+		if (r <= 0) throw "can not write file";
+		done += size_t(r);
+	}
+}
+
+// Buffer is flushed only when full, so its blocks are aligned in the file (except in the last flush, which ends the file).
+// Sparse writer writes runs of data blocks and seeks over runs of zero blocks.
+
+void host_writer::flush(size_t n)
+{
+	if (!sparse) {
+		write_all(buf, n);
+		offset += n;
+		return;
+	}
+
+	auto is_zero = [&](size_t p) { return all_zero(buf + p, min<size_t>(sparse_block, n - p)); };
+
+	size_t p = 0;
+	while (p < n) {
+		auto start = p;
+		bool zero = is_zero(p);
+		do {
+			p = min<size_t>(p + sparse_block, n);
+		} while (p < n && is_zero(p) == zero);
+
+		if (zero) {
+			if (!seek_to(fd, offset + p)) throw "can not write file";
+		} else {
+			write_all(buf + start, p - start);
+		}
+	}
+	offset += n;
+}
+
+// Buffer is written only when full, so with O_DIRECT all writes except the last one are whole aligned blocks.
+
+void host_writer::commit(size_t n)
+{
+	used += n;
+	if (used == capacity) {
+		flush(used);
+		used = 0;
+	}
+}
+
+void host_writer::write(const void * data, size_t size)
+{
+	auto p = (const byte *)data;
+	while (size > 0) {
+		auto n = min(size, available());
+		memcpy(buffer(), p, n);
+		p += n;
+		size -= n;
+		commit(n);
+	}
+}
+
+void host_writer::close()
+{
+	if (fd < 0) return;
+	if (direct) end_direct(fd, direct);
+	flush(used);
+	used = 0;
+
+	// file ending by zeros has not been extended by writes
+	if (sparse && !set_size(fd, offset)) throw "can not write file";
+
+#ifdef _WIN32
+	auto r = _close(fd);
+#else
+	auto r = ::close(fd);
+#endif
+	fd = -1;
+	if (r != 0) throw "can not write file";
+}
+
+// Holes are punched for runs of zero blocks aligned in the file. The file is read by large blocks through pooled buffer.
+
+size_t punch_holes(const string & filename)
+{
+#ifdef __linux__
+	int fd = open(filename.c_str(), O_RDWR);
+	if (fd < 0) throw "file does not exist";
+
+	struct stat st;
+	fstat(fd, &st);
+	auto blocks_before = st.st_blocks;
+
+	const size_t block = 4096;
+	const size_t chunk = 256 * 1024;
+	pool_array<byte> data(chunk, false);
+
+	const char * error = nullptr;
+	size_t hole_start = 0, hole_len = 0;
+	auto punch = [&]() {
+		if (hole_len > 0 && !error) {
+			if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(hole_start), off_t(hole_len)) != 0) {
+				error = (errno == EOPNOTSUPP) ? "filesystem does not support sparse files" : "can not write file";
+			}
+		}
+		hole_len = 0;
+	};
+
+	for (size_t pos = 0; !error;) {
+		auto n = pread(fd, data.data(), chunk, off_t(pos));
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) error = "file can not be read";
+		if (n <= 0) break;
+
+		for (size_t p = 0; p < size_t(n); p += block) {
+			auto len = min(block, size_t(n) - p);
+			if (all_zero(data.data() + p, len)) {
+				if (hole_len == 0) hole_start = pos + p;
+				hole_len += len;
+			} else {
+				punch();
+			}
+		}
+		pos += size_t(n);
+	}
+	punch();
+
+	fstat(fd, &st);
+	close(fd);
+	if (error) throw error;
+	return st.st_blocks < blocks_before ? size_t(blocks_before - st.st_blocks) * 512 : 0;
+#else
+	throw "sparse files are not supported on this system";
+#endif
+}
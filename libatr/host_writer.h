@@ -0,0 +1,59 @@
+/*
+Host file writer
+
+Writes extracted files and disk images to the host. Data are collected in a large pooled buffer and written by few large
+write calls. When the size of the file is known in advance, space is reserved for it first (fallocate on Linux),
+so the host filesystem allocates it in one piece.
+
+Sparse writer does not write blocks of zeros, it seeks over them and sets the size of the file at the end,
+so mostly empty images take only the space of their used sectors (on filesystems supporting sparse files).
+
+When compiled with ATR_DIRECT_IO (Linux), files of at least 1 MB are written with O_DIRECT, bypassing the page cache.
+If the destination does not support it (e.g. tmpfs or network filesystem), the file is written normally.
+*/
+
+#pragma once
+
+#include "disk.h"
+#include <string>
+
+class host_writer
+{
+public:
+	host_writer(const std::string & filename, size_t size = 0, bool sparse = false);	// size: expected size of the file, 0 if not known
+	~host_writer();
+
+	// Free part of the buffer, data placed there are written by commit.
+	byte * buffer() { return buf + used; }
+	size_t available() const { return capacity - used; }
+	void commit(size_t n);
+
+	void write(const void * data, size_t size);
+	void close();				// write the rest of data, throws on error
+
+private:
+	host_writer(const host_writer &) = delete;
+	host_writer & operator=(const host_writer &) = delete;
+
+	enum {
+		buffer_size  = 256 * 1024,
+		direct_min   = 1024 * 1024,		// smaller files are not worth bypassing the cache
+		direct_align = 4096,
+		sparse_block = 4096			// zero blocks aligned to this size are skipped by sparse writer
+	};
+
+	void flush(size_t n);		// write first n bytes of the buffer
+	void write_all(const byte * data, size_t n);
+
+	int fd;
+	bool direct;
+	bool sparse;
+	size_t offset;				// position of the buffer in the file
+	byte * mem;					// pooled buffer
+	byte * buf;					// aligned start of the buffer
+	size_t capacity;
+	size_t used;
+};
+
+// Deallocate blocks of zeros in existing file (Linux), returns number of bytes freed on the disk.
+size_t punch_holes(const std::string & filename);
@@ -8,44 +8,67 @@
 #include "mydos.h"
 #include "rkdos.h"
 
-filesystem * detect_filesystem(disk * d)
+template <class FS> static filesystem * open_filesystem(disk * d)
 {
-	filesystem * fs;
-	if (xdos::detect(d)) {
-		fs = new xdos(d);
-	} else if(dos_IIplus::detect(d)) {
-		fs = new dos_IIplus(d);
-	} else if (rkdos::detect(d)) {
-		fs = new rkdos(d);
-	} else if (sparta_dos::detect(d)) {
-		fs = new sparta_dos(d);
-	} else if (mydos::detect(d)) {
-		fs = new mydos(d);
-	} else if (dos2::detect(d)) {
-		fs = new dos2(d);
-	} else {
-		fs = new dos25(d);
+	return new (d->memory()) FS(d);
+}
+
+template <class FS> static filesystem_type filesystem_entry(const char * name, const char * alias = nullptr)
+{
+	return { name, alias, FS::detect, open_filesystem<FS>, FS::format, FS::property_table };
+}
+
+const filesystem_type * filesystem_types()
+{
+	static const filesystem_type list[] = {
+		filesystem_entry<xdos>("xdos"),
+		filesystem_entry<dos_IIplus>("II+"),
+		filesystem_entry<rkdos>("rkdos"),
+		filesystem_entry<sparta_dos>("sparta"),
+		filesystem_entry<mydos>("mydos"),
+		filesystem_entry<dos2>("2"),
+		filesystem_entry<dos25>("2.5", "2.0"),
+		{ nullptr, nullptr, nullptr, nullptr, nullptr, nullptr }
+	};
+	return list;
+}
+
+const filesystem_type * find_filesystem_type(const std::string & name)
+{
+	for (auto type = filesystem_types(); type->name; type++) {
+		if (name == type->name || (type->alias && name == type->alias)) return type;
 	}
-	return fs;
+	return nullptr;
 }
 
-filesystem * install_filesystem(disk * d, const std::string & dos_type)
+const filesystem_type * detect_filesystem_type(disk * d, int * confidence)
 {
-	if (dos_type == "xdos") {
-		return xdos::format(d);
-	} else if (dos_type == "II+") {
-		return dos_IIplus::format(d);
-	} else if (dos_type == "2") {
-		return dos2::format(d);
-	} else if (dos_type == "2.5" || dos_type == "2.0") {
-		return dos25::format(d);
-	} else if (dos_type == "sparta") {
-		return sparta_dos::format(d);
-	} else if (dos_type == "mydos") {
-		return mydos::format(d);
-	} else if (dos_type == "rkdos") {
-		return rkdos::format(d);
-	} else {
-		throw "Unknown dos format";
+	filesystem::detect_info info;
+	info.d = d;
+	info.boot = d->sector_ptr(1);
+	info.vtoc = (d->sector_count() >= 360) ? d->sector_ptr(360) : nullptr;
+
+	const filesystem_type * best = nullptr;
+	int best_score = -1;
+	for (auto type = filesystem_types(); type->name; type++) {
+		auto score = type->detect(info);
+		if (score > best_score) {
+			best = type;
+			best_score = score;
+		}
 	}
-}
\ No newline at end of file
+	if (confidence) *confidence = best_score;
+	return best;
+}
+
+filesystem * detect_filesystem(disk * d, int * confidence)
+{
+	return detect_filesystem_type(d, confidence)->open(d);
+}
+
+filesystem * install_filesystem(disk * d, const std::string & dos_type)
+{
+	auto type = find_filesystem_type(dos_type);
+	if (!type) throw "Unknown dos format";
+	return type->format(d);
+}
@@ -2,5 +2,23 @@
 
 #include "filesystem.h"
 
-filesystem * detect_filesystem(disk * d);
+// Registry of supported filesystems
+
+struct filesystem_type
+{
+	const char * name;				// name used in FORMAT command, same as filesystem::name()
+	const char * alias;				// alternative name, nullptr if none
+	int (*detect)(const filesystem::detect_info & info);	// confidence, see filesystem::detect_confidence
+	filesystem * (*open)(disk * d);
+	filesystem * (*format)(disk * d);
+	const filesystem::property * (*properties)();	// known without opening the filesystem
+};
+
+// Table is terminated by entry with nullptr name.
+// When more filesystems are detected with the same confidence, the earlier one wins.
+const filesystem_type * filesystem_types();
+const filesystem_type * find_filesystem_type(const std::string & name);
+
+const filesystem_type * detect_filesystem_type(disk * d, int * confidence = nullptr);
+filesystem * detect_filesystem(disk * d, int * confidence = nullptr);
 filesystem * install_filesystem(disk * d, const std::string & dos_type);
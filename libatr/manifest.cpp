@@ -0,0 +1,293 @@
+#include "manifest.h"
+#include <fstream>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+	bool is_space(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+	}
+
+	const char * skip_space(const char * s, const char * end)
+	{
+		while (s < end && is_space(*s)) s++;
+		return s;
+	}
+
+	// Next token separated by white space, s is moved after it.
+
+	text_view token(const char *& s, const char * end)
+	{
+		s = skip_space(s, end);
+		auto start = s;
+		while (s < end && !is_space(*s)) s++;
+		return text_view(start, s - start);
+	}
+
+	bool parse_number(text_view t, int base, size_t & value)
+	{
+		if (t.empty()) return false;
+		value = 0;
+		for (size_t i = 0; i < t.len; i++) {
+			char c = t.ptr[i];
+			int d;
+			if (c >= '0' && c <= '9') d = c - '0';
+			else if (base == 16 && c >= 'a' && c <= 'f') d = c - 'a' + 10;
+			else if (base == 16 && c >= 'A' && c <= 'F') d = c - 'A' + 10;
+			else return false;
+			value = value * base + d;
+			if (value > 0xffffff) return false;
+		}
+		return true;
+	}
+
+	// Value of numeric property, decimal or hexadecimal starting with $.
+
+	int parse_property_value(text_view t)
+	{
+		auto s = t.ptr, end = t.ptr + t.len;
+		auto v = token(s, end);
+		if (!token(s, end).empty()) throw "invalid property value";
+		int base = 10;
+		if (!v.empty() && v.ptr[0] == '$') {
+			base = 16;
+			v = text_view(v.ptr + 1, v.len - 1);
+		}
+		size_t value;
+		if (!parse_number(v, base, value)) throw "invalid property value";
+		return int(value);
+	}
+
+	bool host_file_size(const string & path, size_t & size)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0) return false;
+		size = size_t(st.st_size);
+		return true;
+	}
+
+	size_t text_file_size(const string & path)
+	{
+		ifstream f(path, ios::binary);
+		char buf[16384];
+		size_t size = 0;
+		while (f.read(buf, sizeof(buf)) || f.gcount() > 0) {
+			size += utf8_atascii_size(buf, size_t(f.gcount()));
+		}
+		return size;
+	}
+}
+
+manifest::manifest() : error_line(0), text(nullptr), size(0), fs_type(nullptr), disk_created(false)
+{
+}
+
+manifest::~manifest()
+{
+#ifndef _WIN32
+	if (text && buf.empty()) munmap((void *)text, size);
+#endif
+}
+
+void manifest::map(const string & filename)
+{
+#ifndef _WIN32
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) throw "dir file does not exist";
+	struct stat st;
+	bool empty = false;			// when the size is not known, the file is read by the stream
+	if (fstat(fd, &st) == 0) {
+		empty = st.st_size == 0;
+		if (!empty) {
+			auto p = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				text = (const char *)p;
+				size = size_t(st.st_size);
+			}
+		}
+	}
+	close(fd);
+	if (text || empty) return;
+#endif
+	ifstream f(filename, ios::binary);
+	if (!f.is_open()) throw "dir file does not exist";
+	buf.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+	buf.push_back(0);		// buffer is not empty even for empty file
+	text = buf.data();
+	size = buf.size() - 1;
+}
+
+void manifest::load(const string & filename)
+{
+	map(filename);
+
+	auto s = text, end = text + size;
+	error_line = 0;
+	while (s < end) {
+		error_line++;
+		auto eol = (const char *)memchr(s, '\n', end - s);
+		if (!eol) eol = end;
+		parse_line(s, eol);
+		s = eol + 1;
+	}
+	error_line = 0;
+}
+
+void manifest::parse_line(const char * s, const char * end)
+{
+	if (s == end || *s == ';') return;
+
+	command c;
+	c.line = error_line;
+	c.nesting = 0;
+	c.format = file_format::bin;
+	c.sector_size = 0;
+	c.sector_count = 0;
+	c.fs = nullptr;
+	c.prop = nullptr;
+	c.value = 0;
+	c.size = 0;
+	memset(c.name, 0, sizeof(c.name));
+
+	auto t = token(s, end);
+	if (t.empty()) return;
+
+	while (t == "|") {
+		c.nesting++;
+		t = token(s, end);
+	}
+
+	if (c.nesting > host_dirs.size()) throw "invalid dir nesting";
+	host_dirs.resize(c.nesting);
+
+	if (t == "DISK") {
+		if (disk_created) throw "DISK must precede FORMAT and BOOT";
+		if (!parse_number(token(s, end), 10, c.sector_count) || !parse_number(token(s, end), 10, c.sector_size)) {
+			throw "DISK requires number of sectors and sector size";
+		}
+		if (c.sector_size != 128 && c.sector_size != 256 && c.sector_size != 512) throw "invalid sector size";
+		if (c.sector_count < 4 || c.sector_count > 65535) throw "invalid number of sectors";
+		c.type = command_type::disk;
+
+	} else if (t == "FORMAT") {
+		if (fs_type) throw "FORMAT specified more than once";
+		auto name = token(s, end).str();
+		fs_type = find_filesystem_type(name);
+		if (!fs_type) throw "Unknown dos format";
+		c.type = command_type::format;
+		c.fs = fs_type;
+		disk_created = true;
+
+	} else if (t == "BOOT") {
+		c.type = command_type::boot;
+		c.filename = token(s, end);
+		if (c.filename.empty()) throw "no filename";
+		if (!host_file_size(c.filename.str(), c.size)) throw "file does not exist";
+		disk_created = true;
+
+	} else if (fs_type && (c.prop = filesystem::find_property(fs_type->properties(), t.ptr, t.len))) {
+		c.type = command_type::property;
+		c.text = text_view(s, end - s);
+		if (c.text.len > 0 && c.text.ptr[c.text.len - 1] == '\r') c.text.len--;
+		if (c.prop->size <= 2) c.value = parse_property_value(c.text);
+
+	} else {
+		if (!fs_type) throw "FORMAT must precede files and directories";
+
+		if (t == "/") {
+			c.type = command_type::dir;
+			c.filename = token(s, end);
+		} else {
+			c.type = command_type::file;
+			if (t == "---") {
+				c.format = file_format::empty;
+				c.filename = t;
+			} else if (t == "BIN" || t == "DOS" || t == "TXT") {
+				c.format = (t == "DOS") ? file_format::dos : (t == "TXT") ? file_format::txt : file_format::bin;
+				c.filename = token(s, end);
+			} else {
+				c.filename = t;
+			}
+		}
+
+		// Atari name follows host name, when it is missing host name is used
+
+		while (end > s && is_space(end[-1])) end--;
+		if (!atascii_encode_name(s, end, c.name, 8, 3)) {
+			auto f = c.filename.ptr;
+			atascii_encode_name(f, f + c.filename.len, c.name, 8, 3);
+		}
+
+		if (c.type == command_type::dir) {
+			if (c.filename.empty()) throw "no directory name";
+			host_dirs.push_back(c.filename);
+		} else if (c.format != file_format::empty) {
+			if (c.filename.empty()) throw "no filename";
+			for (auto & d : host_dirs) {
+				c.path += d.str();
+				c.path += '/';
+			}
+			c.path += c.filename.str();
+			if (!host_file_size(c.path, c.size)) throw "file does not exist";
+			if (c.format == file_format::txt) c.size = text_file_size(c.path);
+		}
+	}
+
+	commands.push_back(move(c));
+}
+
+void manifest::plan(filesystem * fs)
+{
+	struct dir_plan {
+		size_t entries;
+		size_t bytes;
+		disk::sector_num sectors;
+	};
+
+	// sectors of directories are updated as entries are added, closed directories keep their sectors in used
+
+	vector<dir_plan> dirs(1, dir_plan{ 0, 0, 0 });
+	disk::sector_num used = 0;
+	auto free = fs->free_sector_count();
+
+	for (auto & c : commands) {
+		if (c.type != command_type::file && c.type != command_type::dir) continue;
+		error_line = c.line;
+
+		dirs.resize(c.nesting + 1);
+		auto & d = dirs.back();
+		bool root = (c.nesting == 0);
+		auto capacity = fs->dir_capacity(root);
+		if (capacity && d.entries == capacity) throw "dir full";
+		d.entries++;
+		d.bytes += fs->dir_entry_bytes(c.name);
+		auto sectors = fs->dir_sectors(d.bytes, root);
+		used += sectors - d.sectors;
+		d.sectors = sectors;
+
+		if (c.type == command_type::dir) {
+			auto sub = dir_plan{ 0, 0, fs->dir_sectors(0, false) };
+			used += sub.sectors;
+			dirs.push_back(sub);
+		} else {
+			used += fs->file_sectors(c.size);
+		}
+
+		if (used > free) throw "disk full";
+	}
+	error_line = 0;
+}
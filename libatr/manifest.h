@@ -0,0 +1,108 @@
+/*
+Dir file parser
+
+The whole dir file is mapped into memory and tokenized in place, names and values are views into the mapped text.
+Complete list of commands is built and checked before the disk is created, so errors in the dir file are reported
+before any sector is written:
+
+ * DISK must precede FORMAT and BOOT, FORMAT is specified once and precedes files and directories
+ * filesystem and its properties exist, property values are valid numbers
+ * directory nesting is valid and Atari names fit into 8.3
+ * host files exist (relative to the host directories of enclosing directories)
+
+When the filesystem is formatted, plan computes sectors needed by the files and directories, so the disk full
+and directory full errors are reported before the files are written.
+*/
+
+#pragma once
+
+#include "libatr.h"
+#include <string>
+#include <vector>
+
+// Text in memory owned by somebody else
+
+struct text_view
+{
+	const char * ptr;
+	size_t len;
+
+	text_view() : ptr(nullptr), len(0) {}
+	text_view(const char * ptr, size_t len) : ptr(ptr), len(len) {}
+
+	bool empty() const { return len == 0; }
+	bool operator==(const char * s) const { return strncmp(ptr, s, len) == 0 && s[len] == 0; }
+	bool operator!=(const char * s) const { return !(*this == s); }
+	std::string str() const { return std::string(ptr, len); }
+};
+
+class manifest
+{
+public:
+
+	enum class command_type {
+		disk,
+		format,
+		boot,
+		property,
+		file,
+		dir
+	};
+
+	enum class file_format {
+		empty,
+		bin,
+		dos,
+		txt
+	};
+
+	struct command
+	{
+		command_type type;
+		size_t line;
+		size_t nesting;					// number of | before the command
+
+		text_view filename;				// file, boot: host file, dir: host directory
+		std::string path;				// file: host file relative to the directory where packing started
+		size_t size;					// file: size on Atari disk
+		char name[12];					// file, dir: Atari name (8.3 padded by spaces)
+		file_format format;				// file
+
+		size_t sector_size;				// disk
+		disk::sector_num sector_count;
+
+		const filesystem_type * fs;		// format
+
+		const filesystem::property * prop;	// property
+		text_view text;					// property: text after property name
+		int value;						// property: numeric value (properties of size 1 or 2)
+	};
+
+	manifest();
+	~manifest();
+
+	// Parse dir file. Throws on error, error_line is then the line with the error (0 if the file can not be read).
+	void load(const std::string & filename);
+
+	// Check that files and directories fit on freshly formatted filesystem. Throws "disk full" or "dir full"
+	// with error_line set to the first command that does not fit.
+	void plan(filesystem * fs);
+
+	std::vector<command> commands;
+	size_t error_line;				// line of the command being processed
+
+private:
+	manifest(const manifest &) = delete;
+	manifest & operator=(const manifest &) = delete;
+
+	void map(const std::string & filename);
+	void parse_line(const char * s, const char * end);
+
+	const char * text;					// contents of the dir file
+	size_t size;
+	std::vector<char> buf;				// contents when the file can not be mapped
+
+	std::vector<text_view> host_dirs;	// host directories of enclosing directories
+	const filesystem_type * fs_type;	// filesystem of FORMAT command
+	bool disk_created;
+};
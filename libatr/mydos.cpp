@@ -34,7 +34,7 @@ disk::sector_num mydos::get_dos_first_sector()
 	return read_word(1, BOOT_FILE_LO, BOOT_FILE_HI);
 }
 
-const filesystem::property * mydos::properties()
+const filesystem::property * mydos::property_table()
 {
 	static const filesystem::property props[] = {
 
@@ -47,11 +47,14 @@ const filesystem::property * mydos::properties()
 	return props;
 }
 
-bool mydos::detect(disk * d)
+const filesystem::property * mydos::properties()
+{
+	return property_table();
+}
+
+int mydos::detect(const detect_info & info)
 {
-	auto s = d->get_sector(1);
-	bool a = s->buf[0] == 'M';
-	return a;
+	return (info.boot[0] == 'M') ? detect_likely : detect_none;
 }
 
 mydos::mydos(disk * d) : expanded_vtoc(d, d->sector_size() > 128)
@@ -60,7 +63,7 @@ mydos::mydos(disk * d) : expanded_vtoc(d, d->sector_size() > 128)
 
 filesystem * mydos::format(disk * d)
 {
-	mydos * fs = new mydos(d);
+	mydos * fs = new (d->memory()) mydos(d);
 	byte version = 3;
 	if (d->sector_size() > 128) version = 0x23;
 	fs->vtoc_format(0xffff, false, version);
@@ -69,7 +72,7 @@ filesystem * mydos::format(disk * d)
 
 filesystem::dir * mydos::root_dir()
 {
-	return new mydos_dir(*this, DIR_FIRST_SECTOR);
+	return new (memory()) mydos_dir(*this, DIR_FIRST_SECTOR);
 }
 
 mydos::mydos_dir::mydos_dir(mydos & fs, disk::sector_num sector) : dos2_dir(fs, sector)
@@ -79,12 +82,23 @@ mydos::mydos_dir::mydos_dir(mydos & fs, disk::sector_num sector) : dos2_dir(fs,
 
 bool mydos::mydos_dir::is_dir()
 {
-	return (fs.read_byte(sector, pos) & FLAG_DIRECTORY) != 0;
+	return is_dir_flag(fs.read_byte(sector, pos));
+}
+
+bool mydos::mydos_dir::is_dir_flag(byte flags)
+{
+	return (flags & FLAG_DIRECTORY) != 0;
 }
 
 filesystem::dir * mydos::mydos_dir::open_dir()
 {
-	return new mydos_dir(static_cast<mydos&>(fs), fs.read_word(sector, pos + 3));
+	return new (fs.memory()) mydos_dir(static_cast<mydos&>(fs), fs.read_word(sector, pos + 3));
+}
+
+disk::sector_num mydos::dir_sectors(size_t bytes, bool root)
+{
+	// subdirectory has the same size as the main directory
+	return root ? 0 : DIR_SIZE;
 }
 
 disk::sector_num mydos::alloc_dir()
@@ -97,7 +111,7 @@ disk::sector_num mydos::alloc_dir()
 	auto vtoc = get_sector(vtoc_secno);
 
 	for (size_t i = 0; i < vtoc_size; i++) {
-		auto b = vtoc->buf[VTOC_BITMAP + i];
+		auto b = vtoc.buf[VTOC_BITMAP + i];
 		for (byte m = 128; m != 0; m /= 2) {
 			if (b & m) {
 				if (size == 0) start = sec;
@@ -122,7 +136,7 @@ filesystem::dir * mydos::mydos_dir::create_dir(char * name)
 	auto first_sector = static_cast<mydos&>(fs).alloc_dir();
 	auto file_no = alloc_entry(name, FLAG_IN_USE | FLAG_DIRECTORY, first_sector, &sector, &offset);
 
-	auto dir = new mydos_dir(static_cast<mydos&>(fs), first_sector);
+	auto dir = new (fs.memory()) mydos_dir(static_cast<mydos&>(fs), first_sector);
 	dir->format();
 	return dir;
 }
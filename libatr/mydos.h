@@ -93,12 +93,14 @@ public:
 
 	std::string name();
 	const property * properties();
+	static const property * property_table();
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
 
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
+	disk::sector_num dir_sectors(size_t bytes, bool root) override;
 
 	class mydos_dir : public dos2_dir {
 	public:
@@ -106,6 +108,9 @@ public:
 		bool is_dir() override;
 		dir * open_dir() override;
 		dir * create_dir(char * name) override;
+
+	protected:
+		bool is_dir_flag(byte flags) override;
 	};
 
 	filesystem::dir * root_dir() override;
@@ -0,0 +1,73 @@
+#include "prefetch.h"
+#include <fstream>
+
+using namespace std;
+
+static bool read_file(const string & path, vector<byte> & data)
+{
+	ifstream f(path, ios::binary | ios::ate);
+	if (!f.is_open()) return false;
+	auto size = f.tellg();
+	if (size < 0) return false;
+	data.resize(size_t(size));
+	f.seekg(0);
+	return size == 0 || bool(f.read((char *)data.data(), size));
+}
+
+prefetch::prefetch(const vector<string> & paths, size_t threads, size_t window)
+	: paths(paths), slots(paths.size()), window(window), next_read(0), next_take(0), stop(false)
+{
+	for (auto & s : slots) s.state = slot_waiting;
+	threads = min(threads, paths.size());
+	for (size_t i = 0; i < threads; i++) {
+		workers.emplace_back(&prefetch::worker, this);
+	}
+}
+
+prefetch::~prefetch()
+{
+	{
+		lock_guard<mutex> lock(m);
+		stop = true;
+	}
+	read_cv.notify_all();
+	for (auto & w : workers) w.join();
+}
+
+void prefetch::worker()
+{
+	unique_lock<mutex> lock(m);
+	for (;;) {
+		read_cv.wait(lock, [this] { return stop || (next_read < paths.size() && next_read < next_take + window); });
+		if (stop) return;
+
+		auto i = next_read++;
+		vector<byte> data;
+		if (!pool.empty()) {
+			data.swap(pool.back());
+			pool.pop_back();
+		}
+		lock.unlock();
+
+		bool ok = read_file(paths[i], data);
+
+		lock.lock();
+		slots[i].data.swap(data);
+		slots[i].state = ok ? slot_ready : slot_failed;
+		ready_cv.notify_all();
+	}
+}
+
+void prefetch::next(vector<byte> & data)
+{
+	unique_lock<mutex> lock(m);
+	if (next_take == slots.size()) throw "no more files to read";
+	auto & s = slots[next_take];
+	ready_cv.wait(lock, [&s] { return s.state != slot_waiting; });
+	if (s.state == slot_failed) throw "file does not exist";
+
+	pool.push_back(move(data));		// previous buffer of the consumer is reused
+	data.swap(s.data);
+	next_take++;
+	read_cv.notify_all();
+}
@@ -0,0 +1,56 @@
+/*
+Background reading of host files
+
+Files are read by worker threads ahead of the consumer, which takes them one by one in the original order,
+so the result does not depend on the order in which the reads finish. At most window files are read ahead
+and buffers of consumed files are reused for the following ones.
+*/
+
+#pragma once
+
+#include "disk.h"
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+class prefetch
+{
+public:
+	prefetch(const std::vector<std::string> & paths, size_t threads = 4, size_t window = 8);
+	~prefetch();
+
+	// Wait for the next file and swap its contents into data (previous contents of data are reused).
+	// Throws if the file can not be read.
+	void next(std::vector<byte> & data);
+
+private:
+	prefetch(const prefetch &) = delete;
+	prefetch & operator=(const prefetch &) = delete;
+
+	void worker();
+
+	enum slot_state {
+		slot_waiting,
+		slot_ready,
+		slot_failed
+	};
+
+	struct slot
+	{
+		slot_state state;
+		std::vector<byte> data;
+	};
+
+	std::vector<std::string> paths;
+	std::vector<slot> slots;
+	std::vector<std::vector<byte>> pool;	// buffers of consumed files
+	size_t window;
+	size_t next_read;						// next file to be read by a worker
+	size_t next_take;						// next file to be taken by the consumer
+	bool stop;
+
+	std::mutex m;
+	std::condition_variable read_cv;		// workers wait for a file to read
+	std::condition_variable ready_cv;		// consumer waits for the file to be read
+	std::vector<std::thread> workers;
+};
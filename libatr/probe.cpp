@@ -0,0 +1,125 @@
+#include "probe.h"
+#include "libatr.h"
+#include "rkdos.h"
+#include <fstream>
+#include <memory>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// Sectors read by filesystem detection and by the filesystem constructors (boot sectors, VTOC, DOS 2.5 VTOC2).
+
+static const disk::sector_num probe_sectors[] = { 1, 2, 3, 360, 1024 };
+
+class image_file
+{
+public:
+	image_file(const string & filename)
+	{
+#ifdef _WIN32
+		fd = _open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#else
+		fd = open(filename.c_str(), O_RDONLY);
+#endif
+		if (fd < 0) throw "file does not exist";
+	}
+
+	~image_file()
+	{
+#ifdef _WIN32
+		_close(fd);
+#else
+		close(fd);
+#endif
+	}
+
+	size_t size()
+	{
+#ifdef _WIN32
+		return size_t(_lseeki64(fd, 0, SEEK_END));
+#else
+		struct stat st;
+		fstat(fd, &st);
+		return size_t(st.st_size);
+#endif
+	}
+
+	// Read data at specified file offset. Returns number of bytes read, which is less than size at the end of file.
+	size_t read_at(byte * buf, size_t size, size_t offset)
+	{
+		size_t done = 0;
+		while (done < size) {
+#ifdef _WIN32
+			_lseeki64(fd, offset + done, SEEK_SET);
+			auto n = _read(fd, buf + done, unsigned(size - done));
+#else
+			auto n = pread(fd, buf + done, size - done, off_t(offset + done));
+#endif
+			if (n <= 0) break;
+			done += n;
+		}
+		return done;
+	}
+
+private:
+	int fd;
+};
+
+disk_info probe_disk(const string & filename)
+{
+	disk_info info;
+	unique_ptr<disk> d;
+
+	{
+		image_file f(filename);
+		auto file_size = f.size();
+
+		byte head[16];
+		memset(head, 0, sizeof(head));
+		f.read_at(head, sizeof(head), 0);
+
+		auto format = disk::detect_format(head, file_size, filename);
+		if (!format) throw "This file is not an Atari disk file.";
+		info.format = format->name;
+
+		disk::image_layout l;
+		if (format->layout && format->layout(head, file_size, l)) {
+			d.reset(new disk(l.sector_size, l.sector_count));
+			for (auto num : probe_sectors) {
+				if (num > l.sector_count) break;
+				f.read_at(d->sector_ptr(num), d->sector_size(num), l.sector_offset(num));
+			}
+
+			// RK-DOS free list is a chain through the first sectors of free extents, so they are read too.
+
+			filesystem::detect_info di = { d.get(), d->sector_ptr(1), nullptr };
+			if (rkdos::detect(di) != filesystem::detect_none) {
+				rkdos::free_chain(*d, [&](disk::sector_num start, disk::sector_num size) {
+					f.read_at(d->sector_ptr(start), d->sector_size(start), l.sector_offset(start));
+				});
+			}
+		}
+	}
+
+	if (!d) {
+		d.reset(disk::load(filename));
+	}
+
+	info.sector_size = d->sector_size();
+	info.sector_count = d->sector_count();
+
+	unique_ptr<filesystem> fs(detect_filesystem(d.get(), &info.confidence));
+	info.filesystem = fs->name();
+	info.free_sectors = fs->free_sector_count();
+	info.dos_first_sector = fs->get_dos_first_sector();
+
+	return info;
+}
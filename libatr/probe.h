@@ -0,0 +1,27 @@
+/*
+Quick probe of disk image
+
+Reads only the sectors needed to recognize the filesystem (boot sectors, VTOC) instead of loading whole image,
+so the time does not depend on the size of the image. This is useful for triage of large image collections.
+
+Compressed images (DCM, gzip) have no fixed sector placement, they are loaded completely.
+*/
+
+#pragma once
+
+#include "disk.h"
+#include <string>
+
+struct disk_info
+{
+	std::string format;				// container format (atr, xfd, ...)
+	size_t sector_size;
+	disk::sector_num sector_count;
+	std::string filesystem;
+	int confidence;					// confidence of filesystem detection (0..100)
+	disk::sector_num free_sectors;
+	disk::sector_num dos_first_sector;
+};
+
+// Throws message when the file is not a valid disk image, including headers with invalid geometry.
+disk_info probe_disk(const std::string & filename);
@@ -1,4 +1,5 @@
 #include "rkdos.h"
+#include <algorithm>
 
 using namespace std;
 
@@ -10,7 +11,7 @@ std::string rkdos::name()
 }
 
 
-const filesystem::property * rkdos::properties()
+const filesystem::property * rkdos::property_table()
 {
 	static const filesystem::property props[1] = {
 		{ nullptr, 0, 0, 0 }
@@ -19,48 +20,53 @@ const filesystem::property * rkdos::properties()
 	return props;
 }
 
-rkdos::rkdos(disk * d) : filesystem(d)
+const filesystem::property * rkdos::properties()
+{
+	return property_table();
+}
+
+rkdos::rkdos(disk * d) : filesystem(d), free_list(d->memory()), free_list_changed(false)
 {
-	auto s = d->get_sector(root_sec);
-	free_start = s->dpeek(root_first_free);
-	free_size = s->dpeek(root_free_size);
+	free_list_read();
 }
 
 rkdos::~rkdos()
 {
-	auto s = d->get_sector(root_sec);
-	s->dpoke(root_first_free, word(free_start));
-	s->dpoke(root_free_size, free_size);
+	if (free_list_changed) {
+		free_list_write();
+	}
 }
 
 filesystem * rkdos::format(disk * d)
 {
 	auto s = d->init_sector(root_sec);
-	s->poke(root_id1, 'R');
-	s->poke(root_id2, 'K');
+	s.poke(root_id1, 'R');
+	s.poke(root_id2, 'K');
 
-	//fs->free_start = 4;
-	//fs->free_size = word(d->sector_count() - 3);
+	// whole disk after boot sectors is one free extent
 
-	s->dpoke(root_first_free, 4);	//word(fs->free_start)
-	s->dpoke(root_free_size, word(d->sector_count() - 3)); // fs->free_size
+	s.dpoke(root_first_free, 4);
+	s.dpoke(root_free_size, word(d->sector_count() - 3));
+	auto f = d->get_sector(4);
+	f.dpoke(0, 0);
+	f.dpoke(2, 0);
 
-	s->poke(root_entry + dir_entry_size, dir_name);
-	s->poke(root_entry + dir_flags, file_dir);
-	s->dpoke(root_entry + dir_cluster_start, 0);
-	s->poke(root_entry + dir_cluster_size, 0);
-	s->dpoke(root_entry + dir_file_size, 0);
-	s->poke(root_entry + dir_file_size+2, 0);
+	s.poke(root_entry + dir_entry_size, dir_name);
+	s.poke(root_entry + dir_flags, file_dir);
+	s.dpoke(root_entry + dir_cluster_start, 0);
+	s.poke(root_entry + dir_cluster_size, 0);
+	s.dpoke(root_entry + dir_file_size, 0);
+	s.poke(root_entry + dir_file_size+2, 0);
 
-	auto fs = new rkdos(d);
+	auto fs = new (d->memory()) rkdos(d);
 
 	return fs;
 }
 
-bool rkdos::detect(disk * d)
+int rkdos::detect(const detect_info & info)
 {
-	auto s = d->get_sector(root_sec);
-	return s->peek(root_id1) == 'R' && s->peek(root_id2) == 'K';
+	// root sector is the boot sector
+	return (info.boot[root_id1] == 'R' && info.boot[root_id2] == 'K') ? detect_certain : detect_none;
 }
 
 
@@ -68,29 +74,140 @@ filesystem::dir * rkdos::root_dir()
 {
 	auto s = get_sector(root_sec);
 
-	auto root_file = new rkdos_file(*this, nullptr, root_entry, root_sec, 1, 32, false);
-
+	auto root_file = new (memory()) rkdos_file(*this, nullptr, 0, root_sec, 1, 32, false);
 
-	auto file = new rkdos_file(*this, root_file, root_entry, s->dpeek(root_entry+dir_cluster_start), s->peek(root_entry + dir_cluster_size), s->dpeek(root_entry + dir_file_size), false);
-	auto dir = new rkdos_dir(file);
+	size_t size = s.dpeek(root_entry + dir_file_size) + 0x10000 * s.peek(root_entry + dir_file_size + 2);
+	auto file = new (memory()) rkdos_file(*this, root_file, root_entry, s.dpeek(root_entry+dir_cluster_start), s.peek(root_entry + dir_cluster_size), size, false);
+	auto dir = new (memory()) rkdos_dir(file, root_file);
 	return dir;
 }
 
+//////////////////////// free list /////////////////////////////
+
+// Invalid extent ends the list, the count limit stops loops in damaged lists.
+
+void rkdos::free_chain(disk & d, const function<void(disk::sector_num start, disk::sector_num size)> & visit)
+{
+	auto s = d.get_sector(root_sec);
+	disk::sector_num start = s.dpeek(root_first_free);
+	disk::sector_num size = s.dpeek(root_free_size);
+
+	for (disk::sector_num n = 0; start >= 4 && size > 0 && start + size - 1 <= d.sector_count() && n < d.sector_count(); n++) {
+		visit(start, size);
+		auto f = d.get_sector(start);
+		start = f.dpeek(0);
+		size = f.dpeek(2);
+	}
+}
+
+void rkdos::free_list_read()
+{
+	free_list.clear();
+	free_chain(*d, [this](disk::sector_num start, disk::sector_num size) { free_list.push_back({ start, size }); });
+
+	sort(free_list.begin(), free_list.end(), [](const extent & a, const extent & b) { return a.start < b.start; });
+
+	// join neighbouring and overlapping extents
+
+	size_t n = 0;
+	for (size_t i = 0; i < free_list.size(); i++) {
+		auto & e = free_list[i];
+		if (n > 0 && free_list[n - 1].start + free_list[n - 1].size >= e.start) {
+			auto & prev = free_list[n - 1];
+			prev.size = max(prev.start + prev.size, e.start + e.size) - prev.start;
+		} else {
+			free_list[n++] = e;
+		}
+	}
+	free_list.resize(n);
+}
+
+void rkdos::free_list_write()
+{
+	disk::sector_num next = 0, next_size = 0;
+
+	for (auto i = free_list.size(); i-- > 0;) {
+		auto f = get_sector(free_list[i].start);
+		f.dpoke(0, word(next));
+		f.dpoke(2, word(next_size));
+		next = free_list[i].start;
+		next_size = free_list[i].size;
+	}
+
+	auto s = get_sector(root_sec);
+	s.dpoke(root_first_free, word(next));
+	s.dpoke(root_free_size, word(next_size));
+	free_list_changed = false;
+}
+
 disk::sector_num rkdos::alloc_sector()
 {
-	auto r = free_start;
+	if (free_list.empty()) return 0;
 
-	if (free_size > 0) {
-		free_size--;
-		free_start++;
-		return r;
+	auto & e = free_list.front();
+	auto r = e.start;
+	e.start++;
+	e.size--;
+	if (e.size == 0) {
+		free_list.erase(free_list.begin());
 	}
-	return 0;
+	free_list_changed = true;
+	return r;
+}
+
+bool rkdos::alloc_sector_at(disk::sector_num sector)
+{
+	auto it = lower_bound(free_list.begin(), free_list.end(), sector, [](const extent & e, disk::sector_num sec) { return e.start < sec; });
+	if (it == free_list.end() || it->start != sector) return false;
+
+	it->start++;
+	it->size--;
+	if (it->size == 0) {
+		free_list.erase(it);
+	}
+	free_list_changed = true;
+	return true;
 }
 
 disk::sector_num rkdos::free_sector_count()
 {
-	return 0;
+	disk::sector_num count = 0;
+	for (auto & e : free_list) {
+		count += e.size;
+	}
+	return count;
+}
+
+// File stored in clusters of maximal size (as on empty disk), every cluster except the last one ends with link.
+
+disk::sector_num rkdos::file_sectors(size_t size)
+{
+	auto ss = sector_size();
+	auto full = size_t(cluster_max_size) * ss;
+	disk::sector_num sectors = 0;
+	while (size > full) {
+		size -= full - cluster_link_size;
+		sectors += cluster_max_size;
+	}
+	return sectors + (size + ss - 1) / ss;
+}
+
+size_t rkdos::dir_entry_bytes(const char * name)
+{
+	// name and extension without padding, separated by dot
+	size_t len = 0;
+	for (size_t i = 0; i < 8 && name[i] != ' '; i++) len++;
+	if (name[8] != ' ') {
+		len++;
+		for (size_t i = 8; i < 11 && name[i] != ' '; i++) len++;
+	}
+	return dir_name + len;
+}
+
+disk::sector_num rkdos::dir_sectors(size_t bytes, bool root)
+{
+	// directory is a file, the main directory is empty after format
+	return file_sectors(bytes);
 }
 
 disk::sector_num rkdos::get_dos_first_sector()
@@ -104,31 +221,33 @@ void rkdos::set_dos_first_sector(disk::sector_num sector)
 
 //////////////////////// file /////////////////////////////
 
-rkdos::rkdos_file::rkdos_file(rkdos & fs, rkdos_file * dir, word dir_pos,  disk::sector_num cluster_start, byte cluster_size, size_t file_size, bool writing) : fs(fs), file_size(file_size), first_cluster(cluster_start), dir(dir), dir_pos(dir_pos)
+rkdos::rkdos_file::rkdos_file(rkdos & fs, rkdos_file * dir, word dir_pos,  disk::sector_num cluster_start, byte cluster_size, size_t file_size, bool writing) :
+	fs(fs), dir(dir), dir_pos(dir_pos), modified(false),
+	first_cluster(cluster_start), first_cluster_size(cluster_size),
+	file_size(file_size),
+	data_map(fs.memory())
 {
-	cluster_start = first_cluster;
-	first_cluster_size = cluster_size;
-	cluster_end = first_cluster + cluster_size - 1;
-	sector = first_cluster;
-	offset = 0;
-	file_pos = 0;
+	seek(0);
 }
 
 rkdos::rkdos_file::~rkdos_file()
 {
-
-	if (first_cluster_size == 0) {
-		first_cluster_size = word(cluster_end - first_cluster + 1);
+	if (modified && dir) {
+		close();
 	}
+}
 
-	byte buf[7];
-	dir->seek(dir_pos + dir_cluster_start);
+// Write position and size of the file into its directory entry.
+
+void rkdos::rkdos_file::close()
+{
+	byte buf[6];
 	poke_word(buf, 0, word(first_cluster));
 	buf[2] = byte(first_cluster_size);
-
-	//poke_word(buf, 2, word(first_cluster_size));
 	poke_word(buf, 3, word(file_size));
 	buf[5] = byte(file_size >> 16);
+
+	dir->seek(dir_pos + dir_cluster_start);
 	dir->write_bytes(buf, 6);
 }
 
@@ -137,101 +256,183 @@ rkdos & rkdos::rkdos_file::filesystem()
 	return fs;
 }
 
+size_t rkdos::rkdos_file::sector_size()
+{
+	return fs.sector_size();
+}
+
+size_t rkdos::rkdos_file::size()
+{
+	return file_size;
+}
+
 bool rkdos::rkdos_file::eof()
 {
 	return file_size == file_pos;
 }
 
-byte rkdos::rkdos_file::read()
+// Cluster is the last one if the rest of the file fits into it.
+// Link written at the end of cluster moves three bytes into the next cluster, so there are always more.
+
+bool rkdos::rkdos_file::last_cluster()
+{
+	return file_size - cluster_pos <= size_t(cluster_size) * sector_size();
+}
+
+size_t rkdos::rkdos_file::cluster_capacity()
 {
-	if (eof()) throw("EOF");
+	auto bytes = size_t(cluster_size) * sector_size();
+	return last_cluster() ? bytes : bytes - cluster_link_size;
+}
+
+void rkdos::rkdos_file::next_cluster()
+{
+	auto ss = sector_size();
+	auto last = cluster + cluster_size - 1;
+	auto s = fs.get_sector(last);
+
+	cluster_pos += cluster_capacity();
+	link_sector = last;
+	cluster = s.dpeek(ss - cluster_link_size);
+	cluster_size = s.peek(ss - 1);
 
-	auto s = fs.get_sector(sector);
-	byte b = s->peek(offset);
-	file_pos++;
-	offset++;
-	if (offset == fs.sector_size()) {
-		offset = 0;
-		sector++;
+	if (cluster < 4 || cluster_size == 0 || cluster + cluster_size - 1 > fs.sector_count()) throw "invalid cluster link";
+}
+
+size_t rkdos::rkdos_file::size_hint()
+{
+	return file_size;
+}
+
+// Sectors of cluster follow each other in the disk buffer, so data of whole cluster are copied at once.
+
+size_t rkdos::rkdos_file::read_span(byte * data, size_t size)
+{
+	size = min(size, file_size - file_pos);
+	if (size == 0) return 0;
+
+	auto capacity = cluster_capacity();
+	if (file_pos - cluster_pos == capacity) {
+		next_cluster();
+		capacity = cluster_capacity();
 	}
-	return b;
+	auto rel = file_pos - cluster_pos;
+	auto n = min(size, capacity - rel);
+	memcpy(data, fs.d->sector_ptr(cluster) + rel, n);
+	file_pos += n;
+	return n;
 }
 
 void rkdos::rkdos_file::seek(size_t pos)
 {
-	
-	sector = first_cluster;
-	offset = 0;
-	word cluster_size = first_cluster_size;
-	auto remaining = file_size;
-
 	if (pos > file_size) pos = file_size;
 
-	size_t cluster_bytes = cluster_size * fs.sector_size();
+	cluster = first_cluster;
+	cluster_size = first_cluster_size;
+	cluster_pos = 0;
+	link_sector = 0;
 
-	if (cluster_bytes > remaining) {
-		cluster_bytes -= 2;
+	while (!last_cluster() && pos - cluster_pos >= cluster_capacity()) {
+		next_cluster();
 	}
-
-	sector += pos / fs.sector_size();
-	offset = word(pos % fs.sector_size());
 	file_pos = pos;
-
-	cluster_end = sector;
-	cluster_end_offset = word(fs.sector_size());
 }
 
 void rkdos::rkdos_file::seek_end()
 {
-	sector = first_cluster+first_cluster_size;
-	cluster_end = sector;
-	cluster_end_offset = 0;
-	offset = 0;
-	file_pos = file_size;
+	seek(file_size);
 }
 
-void rkdos::rkdos_file::write(byte b)
+// Cluster links are followed once, then any part of file is read directly.
+
+size_t rkdos::rkdos_file::pread(size_t offset, byte * data, size_t size)
 {
-	if (first_cluster == 0) {
-		first_cluster = fs.alloc_sector();
-		sector = first_cluster;
-		cluster_end = sector;
-		cluster_end_offset = word(fs.sector_size());
-	}
+	if (data_map.empty()) {
+		auto ss = sector_size();
+		size_t pos = 0;
+		auto c = first_cluster;
+		size_t n = first_cluster_size;
+		while (pos < file_size) {
+			auto bytes = n * ss;
+			bool last = file_size - pos <= bytes;
+			auto len = last ? file_size - pos : bytes - cluster_link_size;
+			data_map.push_back({ pos, len, c });
+			if (last) break;
 
-	auto s = fs.get_sector(sector);
+			auto s = fs.get_sector(disk::sector_num(c + n - 1));
+			pos += len;
+			c = s.dpeek(ss - cluster_link_size);
+			n = s.peek(ss - 1);
+			if (c < 4 || n == 0 || c + n - 1 > fs.sector_count()) throw "invalid cluster link";
+		}
+	}
+	return fs.read_extents(data_map, offset, data, size);
+}
 
-	// if we are at the end of cluster, we must alloc new block -- note, thet we are not currently solving overwrite
+// Current cluster is full, grow it if the following sector is free, otherwise link new cluster.
 
-	if (offset == cluster_end_offset && sector == cluster_end) {
-		
-		sector = fs.alloc_sector();
-	
-		if (sector == 0) throw "disk full";
-		
-		cluster_end++;
-		offset = 0;
+void rkdos::rkdos_file::append_cluster()
+{
+	auto ss = sector_size();
 
-		if (sector == cluster_end) {
+	if (cluster_size < cluster_max_size && fs.alloc_sector_at(cluster + cluster_size)) {
+		cluster_size++;
+		if (link_sector) {
+			fs.get_sector(link_sector).poke(ss - 1, byte(cluster_size));
 		} else {
-			if (first_cluster_size == 0) first_cluster_size = word(cluster_end - first_cluster);
-			byte b1, b2;
-			b1 = s->peek(fs.sector_size() - 2);
-			b2 = s->peek(fs.sector_size() - 1);
-			s->dpoke(fs.sector_size(), word(sector));
-			write(b1);
-			write(b2);
-			return;
+			first_cluster_size = cluster_size;
 		}
+		return;
 	}
 
-	s->poke(offset, b);
-	offset++;
-	file_pos++;
+	auto next = fs.alloc_sector();
+	if (next == 0) throw "disk full";
+
+	// last bytes of the cluster are replaced by the link and moved to the new cluster
+
+	auto last = cluster + cluster_size - 1;
+	auto s = fs.get_sector(last);
+	auto n = fs.get_sector(next);
+	memcpy(n.buf, s.buf + ss - cluster_link_size, cluster_link_size);
+	s.dpoke(ss - cluster_link_size, word(next));
+	s.poke(ss - 1, 1);
+
+	cluster_pos += size_t(cluster_size) * ss - cluster_link_size;
+	link_sector = last;
+	cluster = next;
+	cluster_size = 1;
+}
+
+// Data are written up to the end of current cluster. Last cluster is always the whole cluster,
+// so writing past the end of file does not need to move the link.
+
+size_t rkdos::rkdos_file::write_span(const byte * data, size_t size)
+{
+	auto ss = sector_size();
+
+	if (file_pos < file_size) {
+		if (file_pos - cluster_pos == cluster_capacity()) {
+			next_cluster();
+		}
+	} else if (first_cluster == 0) {
+		first_cluster = fs.alloc_sector();
+		if (first_cluster == 0) throw "disk full";
+		first_cluster_size = 1;
+		cluster = first_cluster;
+		cluster_size = 1;
+	} else if (file_pos - cluster_pos == size_t(cluster_size) * ss) {
+		append_cluster();
+	}
+
+	auto rel = file_pos - cluster_pos;
+	auto n = min(size, cluster_capacity() - rel);
+	memcpy(fs.d->sector_ptr(cluster) + rel, data, n);
+	file_pos += n;
 	if (file_pos > file_size) {
 		file_size = file_pos;
 	}
-
+	modified = true;
+	return n;
 }
 
 disk::sector_num rkdos::rkdos_file::first_sector()
@@ -239,7 +440,7 @@ disk::sector_num rkdos::rkdos_file::first_sector()
 	return first_cluster;
 }
 
-rkdos::rkdos_dir::rkdos_dir(rkdos_file * file) : file(file) {
+rkdos::rkdos_dir::rkdos_dir(rkdos_file * file, rkdos_file * parent) : file(file), parent(parent) {
 	pos = 0;
 	entry_size = 0;
 	if (!file->eof()) {
@@ -254,6 +455,7 @@ rkdos::rkdos_dir::rkdos_dir(rkdos_file * file) : file(file) {
 
 rkdos::rkdos_dir::~rkdos_dir() {
 	delete file;
+	delete parent;
 }
 
 bool rkdos::rkdos_dir::at_end()
@@ -269,16 +471,34 @@ void rkdos::rkdos_dir::next()
 	} else {
 		pos += entry_size;
 		entry_size = file->read();
+		if (entry_size < dir_name - 1) throw "invalid directory entry";
 		buf[0] = entry_size;
-		((filesystem::file *)file)->read(buf + 1, entry_size);
+		if (file->read_bytes(buf + 1, entry_size) < entry_size) throw "invalid directory entry";
 		entry_size++;
 	}
 }
 
+// Position is the offset of entry in directory file.
+
+size_t rkdos::rkdos_dir::tell()
+{
+	return pos;
+}
+
+void rkdos::rkdos_dir::seek(size_t new_pos)
+{
+	file->seek(new_pos);
+	pos = word(new_pos);
+	entry_size = 0;
+	end = false;
+	next();
+}
+
 filesystem::dir * rkdos::rkdos_dir::open_dir()
 {
-//	return file->filesystem().open_dir(first_sector());
-	return nullptr;
+	auto & fs = file->filesystem();
+	auto f = new (fs.memory()) rkdos_file(fs, file, pos, cluster_start(), cluster_size(), size(), false);
+	return new (fs.memory()) rkdos_dir(f);
 }
 
 bool  rkdos::rkdos_dir::is_dir()
@@ -288,43 +508,14 @@ bool  rkdos::rkdos_dir::is_dir()
 
 bool  rkdos::rkdos_dir::is_deleted()
 {
-	//return (buf[0] & FLAG_DELETED) != 0;
-	return false;
+	return (buf[dir_flags] & file_deleted) != 0;
 }
 
 std::string rkdos::rkdos_dir::name()
 {
-	char t[4 * 24];
-	bool inverse = false;
-	byte * filename = buf + dir_name;
-	byte len = buf[dir_entry_size] - dir_name;
-
-	size_t p = 0, non_space = 0;
-	for (size_t i = 0; i < 11; i++) {
-		byte b = filename[i];
-		if (b >= 128) {
-			if (!inverse) {
-				inverse = true;
-				t[p++] = '\\'; t[p++] = 'i';
-			}
-			b = b & 0x7f;
-		} else {
-			if (inverse) {
-				t[p++] = '\\'; t[p++] = 'i';
-				inverse = false;
-			}
-		}
-		if (b < 32 || b == 123 || b >= 125) {
-			const char * hex_digit = "0123456789ABCDEF";
-			t[p++] = '\\'; t[p++] = 'x'; t[p++] = hex_digit[b >> 4]; t[p++] = hex_digit[b & 0xf];
-		} else {
-			if (b == ' ' || b == '\\') t[p++] = '\\';
-			char c = char(b);
-			t[p++] = c;
-		}
-		if (b != ' ' || inverse) non_space = p;
-	}
-	t[non_space] = 0;
+	size_t len = entry_size - dir_name;
+	char t[atascii_name_size(256)];
+	atascii_decode_name(buf + dir_name, len, len, t);
 	return string(t);
 }
 
@@ -343,6 +534,36 @@ byte rkdos::rkdos_dir::cluster_size()
 	return buf[dir_cluster_size];
 }
 
+// Rest of the directory is read at once and decoded from memory.
+
+void rkdos::rkdos_dir::snapshot(std::vector<entry> & entries)
+{
+	if (at_end()) return;
+
+	auto sec_size = file->filesystem().sector_size();
+	std::vector<byte> data(entry_size + file->size() - (pos + entry_size));
+	memcpy(data.data(), buf, entry_size);
+	file->read_bytes(data.data() + entry_size, data.size() - entry_size);
+
+	for (size_t i = 0; i < data.size();) {
+		auto b = &data[i];
+		size_t len = b[dir_entry_size] + 1;
+		if (len < dir_name || i + len > data.size()) throw "invalid directory entry";
+		entry e;
+		set_entry_name(e, b + dir_name, len - dir_name, len - dir_name);
+		e.flags = b[dir_flags];
+		e.is_dir = (b[dir_flags] & file_dir) != 0;
+		e.is_deleted = (b[dir_flags] & file_deleted) != 0;
+		e.first_sector = peek_word(b, dir_cluster_start);
+		e.size = peek_word(b, dir_file_size) + 0x10000 * b[dir_file_size + 2];
+		e.sec_size = (e.size + sec_size - 1) / sec_size;
+		e.pos = pos + i;
+		entries.push_back(e);
+		i += len;
+	}
+	end = true;
+}
+
 size_t rkdos::rkdos_dir::sec_size()
 {
 	auto sec_size = file->filesystem().sector_size();
@@ -352,23 +573,49 @@ size_t rkdos::rkdos_dir::sec_size()
 
 filesystem::file * rkdos::rkdos_dir::open_file()
 {
-	return new rkdos_file(file->filesystem(), file, 0, cluster_start(), cluster_size(), size(), false);
+	auto & fs = file->filesystem();
+	return new (fs.memory()) rkdos_file(fs, file, pos, cluster_start(), cluster_size(), size(), false);
 }
 
-filesystem::file * rkdos::rkdos_dir::create_file(char * name)
+// Append entry to the directory, returns its position.
+// Names are stored without padding, name and extension are separated by dot.
+
+word rkdos::rkdos_dir::add_entry(const char * name, byte flags)
 {
-	byte buf[48];
+	byte buf[dir_name + 12];
 	memset(buf, 0, sizeof(buf));
 
-	byte name_len = byte(strlen(name));
-	buf[dir_entry_size] = name_len + dir_name - 1;
-	buf[dir_flags] = 0;
-	memcpy(&buf[dir_name], name, name_len);
+	size_t len = 0;
+	for (size_t i = 0; i < 8 && name[i] != ' '; i++) {
+		buf[dir_name + len++] = name[i];
+	}
+	if (name[8] != ' ') {
+		buf[dir_name + len++] = '.';
+		for (size_t i = 8; i < 11 && name[i] != ' '; i++) {
+			buf[dir_name + len++] = name[i];
+		}
+	}
+
+	buf[dir_entry_size] = byte(dir_name + len - 1);
+	buf[dir_flags] = flags;
 
+	file->filesystem().dir_changed();
 	file->seek_end();
-	file->write_bytes(buf, size_t(buf[0]+1));
+	auto entry = word(file->size());
+	file->write_bytes(buf, dir_name + len);
+	return entry;
+}
 
-	auto f = new rkdos_file(file->filesystem(), file, 0, 0, 0, 0, true);
+filesystem::file * rkdos::rkdos_dir::create_file(char * name)
+{
+	auto entry = add_entry(name, 0);
+	auto & fs = file->filesystem();
+	return new (fs.memory()) rkdos_file(fs, file, entry, 0, 0, 0, true);
+}
 
-	return f;
+filesystem::dir * rkdos::rkdos_dir::create_dir(char * name)
+{
+	auto entry = add_entry(name, file_dir);
+	auto & fs = file->filesystem();
+	return new (fs.memory()) rkdos_dir(new (fs.memory()) rkdos_file(fs, file, entry, 0, 0, 0, true));
 }
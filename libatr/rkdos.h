@@ -1,18 +1,32 @@
 #pragma once
 
 #include "filesystem.h"
+#include "file_io.h"
+#include <functional>
+#include <vector>
 
 /*
 Sector 1:
 
-	
+	6,7   'RK'
+	8,9   first sector of the first free extent
+	10,11 size of the first free extent
+	12    directory entry of the root directory (without name)
+
+Files are stored in clusters of consecutive sectors (at most 255 sectors).
+Directory entry contains start and size of the first cluster. When file continues in another cluster,
+last three bytes of the cluster contain start (2 bytes) and size (1 byte) of the next cluster.
+Cluster is the last one when the rest of the file fits into it, so the last cluster has no link.
+
+Free space is list of free extents. First sector of every free extent contains start (2 bytes) and size (2 bytes)
+of the next free extent, 0 ends the list.
 */
 
 
 class rkdos : public filesystem
 {
 public:
-	
+
 	enum dir_entry {
 		dir_entry_size = 0,				// 1 byte
 		dir_flags = 1,					// 1 byte
@@ -39,18 +53,24 @@ public:
 		root_entry_end = root_entry + dir_name		// we have no name here
 	};
 
+	enum cluster_layout {
+		cluster_max_size = 255,
+		cluster_link_size = 3		// link to next cluster at the end of cluster
+	};
+
 	static disk::sector_num root_sec; // = 1
 
-	class rkdos_file : public filesystem::file
+	class rkdos_file : public file_io<rkdos_file>
 	{
+		friend class file_io<rkdos_file>;
 	public:
 
 		rkdos_file(rkdos & fs, rkdos_file * dir, word dir_pos, disk::sector_num cluster_start, byte cluster_size, size_t file_size, bool writing);
 		~rkdos_file();
 
 		bool eof() override;
-		byte read() override;
-		void write(byte b) override;
+		size_t pread(size_t offset, byte * data, size_t size) override;
+		size_t size_hint() override;
 		disk::sector_num first_sector() override;
 
 		rkdos & filesystem();
@@ -61,34 +81,40 @@ public:
 		void seek_end();
 
 	private:
+		size_t read_span(byte * data, size_t size);
+		size_t write_span(const byte * data, size_t size);
+
 		size_t sector_size();
 
+		bool   last_cluster();
+		size_t cluster_capacity();
+		void   next_cluster();
+		void   append_cluster();
+		void   close();
 
 		rkdos & fs;
 		rkdos_file * dir;
-		word         dir_pos;
-
-		disk::sector dir_sector;			// position in directory (used when writing)
-		word         dir_offset;
+		word         dir_pos;				// offset of file entry in directory
+		bool         modified;
 
 		disk::sector_num first_cluster;		// first cluster
 		word             first_cluster_size;
 
-		disk::sector_num cluster_end;
-		word cluster_end_offset;
+		disk::sector_num cluster;			// current cluster
+		word             cluster_size;
+		size_t           cluster_pos;		// position of current cluster data in file
+		disk::sector_num link_sector;		// sector with link to current cluster, 0 for first cluster
 
-		disk::sector_num sector;			// current position in file
-		word offset;
 		size_t  file_pos;
+		size_t  file_size;
 
-		size_t file_size;
-
+		arena_vector<filesystem::data_extent> data_map;	// data of every cluster, for pread
 	};
 
 	class rkdos_dir : public filesystem::dir
 	{
 	public:
-		rkdos_dir(rkdos_file * file);
+		rkdos_dir(rkdos_file * file, rkdos_file * parent = nullptr);
 		~rkdos_dir();
 
 		void next() override;
@@ -101,15 +127,21 @@ public:
 		bool is_deleted() override;
 		dir * open_dir() override;
 		file * create_file(char * name) override;
+		dir * create_dir(char * name) override;
+		size_t tell() override;
+		void seek(size_t pos) override;
+		void snapshot(std::vector<entry> & entries) override;
 
 	private:
 		disk::sector_num cluster_start();
 		byte cluster_size();
+		word add_entry(const char * name, byte flags);
 
 		rkdos_file * file;
+		rkdos_file * parent;		// file containing entry of this directory, deleted with the directory (root only)
 		word  pos;
-		byte entry_size;
-		byte buf[40];
+		word entry_size;
+		byte buf[256];
 		bool end;
 	};
 
@@ -118,19 +150,40 @@ public:
 
 	std::string name() override;
 	const property * properties();
+	static const property * property_table();
 	filesystem::dir * root_dir() override;
 
 	disk::sector_num free_sector_count() override;
+	disk::sector_num file_sectors(size_t size) override;
+	size_t dir_entry_bytes(const char * name) override;
+	disk::sector_num dir_sectors(size_t bytes, bool root) override;
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
+
+	// Follow the chain of free extents. visit is called for every extent before its first sector (holding the link
+	// to the next extent) is read, so the probe can load the sector from the image file.
+	static void free_chain(disk & d, const std::function<void(disk::sector_num start, disk::sector_num size)> & visit);
 
 private:
-	// Free cluster
-	disk::sector_num free_start;
-	word free_size;
 
-	disk::sector_num alloc_sector();
+	// FREE LIST
+	// Free extents are kept sorted by sector number, neighbouring extents are joined when the list is read.
+	// The list is written back to disk when the filesystem is closed.
+
+	struct extent {
+		disk::sector_num start;
+		disk::sector_num size;
+	};
+
+	arena_vector<extent> free_list;
+	bool free_list_changed;
+
+	void free_list_read();
+	void free_list_write();
+
+	disk::sector_num alloc_sector();					// first fit, 0 if the disk is full
+	bool alloc_sector_at(disk::sector_num sector);		// allocate specified sector if it is free
 };
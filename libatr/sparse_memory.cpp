@@ -0,0 +1,89 @@
+#include "sparse_memory.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+// Windows commits the whole range, but physical pages are still assigned on the first access.
+
+void * sparse_alloc(size_t size)
+{
+#ifdef _WIN32
+	auto p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (!p) throw "Not enough memory.";
+#else
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) throw "Not enough memory.";
+#endif
+	return p;
+}
+
+void sparse_free(void * p, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, size);
+#endif
+}
+
+// Released pages of private anonymous memory read as zeros again (Linux MADV_DONTNEED),
+// elsewhere the range is replaced by new zero mapping.
+
+void sparse_clear(void * p, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(p, size, MEM_DECOMMIT);
+	VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE);
+#elif defined(__linux__)
+	madvise(p, size, MADV_DONTNEED);
+#else
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	if (mmap(p, size, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED) memset(p, 0, size);
+#endif
+}
+
+// Eight words are or-ed in every step, so the compiler uses vector instructions for the loop.
+// Non-zero data are usually found in the first bytes, so the result is checked after every 256 bytes.
+
+bool all_zero(const uint8_t * data, size_t size)
+{
+	size_t i = 0;
+	for (; i + 256 <= size; i += 256) {
+		uint64_t acc = 0;
+		for (size_t j = 0; j < 256; j += 64) {
+			uint64_t w[8];
+			memcpy(w, data + i + j, sizeof(w));
+			acc |= w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7];
+		}
+		if (acc) return false;
+	}
+	uint8_t acc = 0;
+	for (; i < size; i++) acc |= data[i];
+	return acc == 0;
+}
+
+void copy_nonzero(uint8_t * dst, const uint8_t * src, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		auto n = min(size - done, sparse_page_size - (uintptr_t(dst + done) & (sparse_page_size - 1)));
+		if (!all_zero(src + done, n)) memcpy(dst + done, src + done, n);
+		done += n;
+	}
+}
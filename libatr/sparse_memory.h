@@ -0,0 +1,30 @@
+/*
+Sparse memory
+
+Large buffers (disks of 1 MB and more) are reserved as anonymous virtual memory instead of being allocated
+from the heap. Page table of the system then works as sparse sector store: untouched 4 KB pages read as
+the shared zero page and get their own memory on the first write. A 16 MB image with few files costs only
+the pages its used sectors are in, while sector_ptr still returns pointer into one contiguous buffer,
+so filesystems copy whole clusters and extents as before.
+
+Loading copies only pages containing data (copy_nonzero), buffers returned to the pool are cleared by
+releasing their pages to the system, so reused buffers stay sparse.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+const size_t sparse_min_size = 1024 * 1024;		// buffers of this size and larger are sparse
+const size_t sparse_page_size = 4096;
+
+void * sparse_alloc(size_t size);				// zeroed, throws when there is not enough memory
+void sparse_free(void * p, size_t size);
+void sparse_clear(void * p, size_t size);		// zero the buffer by releasing its pages, p is start of the buffer
+
+// True if all bytes are zero.
+bool all_zero(const uint8_t * data, size_t size);
+
+// Copy data to zeroed buffer, skipping pages of the destination which would receive only zeros.
+void copy_nonzero(uint8_t * dst, const uint8_t * src, size_t size);
@@ -18,16 +18,23 @@
 #define DIR_SECTOR          0x09  // 2 bytes
 #define TOTAL_SECTOR_COUNT  0x0B  // 2 bytes
 #define FREE_SECTOR_COUNT   0x0d  // 2 bytes
-#define BITMAP_SECTOR_COUNT 0x0F  // 2 bytes
+#define BITMAP_SECTOR_COUNT 0x0F  // 1 byte
 #define BITMAP_SECTOR       0x10  // 2 bytes
 #define DATA_SECTOR_SEARCH  0x12  // 2 bytes
 #define DIR_SECTOR_SEARCH   0x14  // 2 bytes
 #define DISK_VOLUME_NAME    0x16  // 8 bytes
+#define TRACK_COUNT         0x1E  // 1 byte
+#define SECTOR_SIZE_CODE    0x1F  // 1 byte ($80 = 128, $00 = 256 bytes per sector)
 #define FS_VERSION          0x20  // 1 byte
 #define VOLUME_SEQ_NUMBER   0x26  // 1 byte
 #define VOLUME_RND_NUMBER   0x27  // 1 byte
 #define AUTOEXEC_FILE_SECTOR  0x28 // 2 byte
+#define BOOT_LAYOUT_END     0x2A  // end of filesystem data in sector 1
 
+#define SPARTA_VERSION      0x20  // SpartaDOS 2.x filesystem
+
+
+#include <algorithm>
 
 using namespace std;
 
@@ -37,7 +44,7 @@ std::string sparta_dos::name()
 }
 
 
-const filesystem::property * sparta_dos::properties()
+const filesystem::property * sparta_dos::property_table()
 {
 	static const filesystem::property props[2] = {
 		{ "NAME",   1, DISK_VOLUME_NAME, 8 },
@@ -47,18 +54,21 @@ const filesystem::property * sparta_dos::properties()
 	return props;
 }
 
-sparta_dos::sparta_dos(disk * d) : filesystem(d)
+const filesystem::property * sparta_dos::properties()
+{
+	return property_table();
+}
+
+sparta_dos::sparta_dos(disk * d) : filesystem(d), vtoc_dirty(false)
 {
 	auto s = d->get_sector(1);
-	dir_sector = peek_word(s->buf, DIR_SECTOR);
-	free_count = peek_word(s->buf, FREE_SECTOR_COUNT);
+	dir_sector = peek_word(s.buf, DIR_SECTOR);
+	free_count = peek_word(s.buf, FREE_SECTOR_COUNT);
 }
 
 sparta_dos::~sparta_dos()
 {
 	vtoc_write();
-	delete[] dir_buf;
-	delete[] vtoc_buf;
 }
 
 disk::sector_num sparta_dos::free_sector_count()
@@ -66,6 +76,25 @@ disk::sector_num sparta_dos::free_sector_count()
 	return free_count;
 }
 
+disk::sector_num sparta_dos::file_sectors(size_t size)
+{
+	// data sectors and sector maps, file has at least one map
+	auto data = (size + sector_size() - 1) / sector_size();
+	return data + max<size_t>(1, (data + map_entries() - 1) / map_entries());
+}
+
+size_t sparta_dos::dir_entry_bytes(const char * name)
+{
+	return dir_entry_size;
+}
+
+disk::sector_num sparta_dos::dir_sectors(size_t bytes, bool root)
+{
+	// directory starts with header entry, map and first sector of the main directory are allocated by format
+	auto sectors = file_sectors(bytes + dir_entry_size);
+	return root ? sectors - 2 : sectors;
+}
+
 static const filesystem::property dos_props[2] =
 {
 	{ "DOSSEC_LO",   1, AUTOEXEC_FILE_SECTOR, 1 },
@@ -75,7 +104,7 @@ static const filesystem::property dos_props[2] =
 void sparta_dos::set_dos_first_sector(disk::sector_num sector)
 {
 	set_property(&dos_props[0], sector & 0xff);
-	set_property(&dos_props[0], (sector >> 8) & 0xff);
+	set_property(&dos_props[1], (sector >> 8) & 0xff);
 }
 
 disk::sector_num sparta_dos::get_dos_first_sector()
@@ -85,33 +114,164 @@ disk::sector_num sparta_dos::get_dos_first_sector()
 	return ((int)hi * 256) + lo;
 }
 
-bool sparta_dos::detect(disk * d)
+void sparta_dos::install_boot(const std::string & filename)
 {
-	auto buf = new byte[d->sector_size()];
-
-	d->read_sector(1, buf);
+	// Boot sector contains description of the filesystem, which must survive replacing the boot code.
 
-	bool is_sparta = buf[0x06] == 0x4C && (buf[0x07] == 0x80 && buf[0x08] == 0x30) || (buf[0x07] == 0x40 && buf[0x08] == 0x04);
+	byte layout[BOOT_LAYOUT_END - DIR_SECTOR];
+	auto boot = d->sector_ptr(1);
+	memcpy(layout, boot + DIR_SECTOR, sizeof(layout));
+	d->install_boot(filename);
+	memcpy(boot + DIR_SECTOR, layout, sizeof(layout));
+}
 
-	delete[] buf;
-	return is_sparta;
+int sparta_dos::detect(const detect_info & info)
+{
+	// JMP $3080 or JMP $0440
+	auto b = info.boot;
+	bool is_sparta = b[0x06] == 0x4C && ((b[0x07] == 0x80 && b[0x08] == 0x30) || (b[0x07] == 0x40 && b[0x08] == 0x04));
+	return is_sparta ? detect_certain : detect_none;
 }
 
 filesystem * sparta_dos::format(disk * d)
 {
+	if (d->sector_count() > 0xffff) throw "SpartaDOS disk can not have more than 65535 sectors.";
 
-	sparta_dos * fs = new sparta_dos(d);
+	sparta_dos * fs = new (d->memory()) sparta_dos(d);
 
-	fs->dir_format();
 	fs->vtoc_format();
-	fs->vtoc_write();
+	fs->dir_format();
 	return fs;
 }
 
 void sparta_dos::dir_format()
 {
-	// Init DIR
-	memset(dir_buf, 0, sector_size());
+	// Main directory has only the header entry
+
+	dir_sector = alloc_sector(alloc_dir);
+	d->init_sector(dir_sector);
+	d->write_word(1, DIR_SECTOR, word(dir_sector));
+
+	byte header[dir_entry_size];
+	memset(header, 0, sizeof(header));
+	header[0] = FLAG_IN_USE | FLAG_SUBDIRECTORY;
+	header[dir_file_size] = dir_entry_size;
+	memcpy(header + dir_filename, "MAIN       ", 11);
+	file_write_at(dir_sector, 0, header, dir_entry_size);
+}
+
+static size_t peek_size(const byte * buf)
+{
+	return peek_word(buf, 0) + 0x10000 * buf[2];
+}
+
+static void poke_size(byte * buf, size_t size)
+{
+	poke_word(buf, 0, size & 0xffff);
+	buf[2] = byte(size >> 16);
+}
+
+size_t sparta_dos::add_entry(disk::sector_num dir_map, byte flags, disk::sector_num first_map, size_t size, const char * name)
+/*
+Purpose:
+	Append entry to the end of directory and update size of the directory.
+	Returns offset of the new entry in the directory.
+*/
+{
+	dir_changed();
+
+	byte entry[dir_entry_size];
+	memset(entry, 0, sizeof(entry));
+	entry[0] = flags;
+	poke_word(entry, dir_first_sector, word(first_map));
+	poke_size(entry + dir_file_size, size);
+	memcpy(entry + dir_filename, name, 11);
+
+	byte header[dir_entry_size];
+	file_read_at(dir_map, 0, header, dir_entry_size);
+	auto offset = peek_size(header + dir_file_size);
+
+	file_write_at(dir_map, offset, entry, dir_entry_size);
+	set_entry_size(dir_map, 0, offset + dir_entry_size);
+
+	// Size of subdirectory is also stored in its entry in parent directory
+
+	auto parent = peek_word(header, dir_first_sector);
+	if (parent) {
+		file_read_at(parent, 0, entry, dir_entry_size);
+		auto parent_size = peek_size(entry + dir_file_size);
+		for (size_t pos = dir_entry_size; pos < parent_size; pos += dir_entry_size) {
+			file_read_at(parent, pos, entry, dir_entry_size);
+			if ((entry[0] & FLAG_SUBDIRECTORY) && disk::sector_num(peek_word(entry, dir_first_sector)) == dir_map) {
+				set_entry_size(parent, pos, offset + dir_entry_size);
+				break;
+			}
+		}
+	}
+	return offset;
+}
+
+void sparta_dos::set_entry_size(disk::sector_num dir_map, size_t entry, size_t size)
+{
+	byte buf[3];
+	poke_size(buf, size);
+	file_write_at(dir_map, entry + dir_file_size, buf, 3);
+}
+
+disk::sector_num sparta_dos::file_sector(disk::sector_num first_map, size_t index, bool alloc)
+/*
+Purpose:
+	Return data sector with specified index in the file.
+	If alloc is true, missing sector maps and data sectors are allocated, otherwise 0 is returned for them.
+*/
+{
+	auto map = first_map;
+	for (auto m = index / map_entries(); m > 0; m--) {
+		disk::sector_num next = d->read_word(map, 0);
+		if (!next) {
+			if (!alloc) return 0;
+			next = alloc_sector(alloc_dir);
+			auto s = d->init_sector(next);
+			s.dpoke(2, word(map));
+			d->write_word(map, 0, word(next));
+		}
+		map = next;
+	}
+
+	auto offset = 4 + (index % map_entries()) * 2;
+	disk::sector_num sec = d->read_word(map, offset);
+	if (!sec && alloc) {
+		sec = alloc_sector(alloc_dir);
+		d->init_sector(sec);
+		d->write_word(map, offset, word(sec));
+	}
+	return sec;
+}
+
+void sparta_dos::file_read_at(disk::sector_num first_map, size_t offset, byte * data, size_t size)
+{
+	while (size > 0) {
+		auto pos = offset % sector_size();
+		auto n = min(size, sector_size() - pos);
+		auto sec = file_sector(first_map, offset / sector_size(), false);
+		if (sec) {
+			memcpy(data, d->sector_ptr(sec) + pos, n);
+		} else {
+			memset(data, 0, n);
+		}
+		data += n; offset += n; size -= n;
+	}
+}
+
+void sparta_dos::file_write_at(disk::sector_num first_map, size_t offset, const byte * data, size_t size)
+{
+	while (size > 0) {
+		auto pos = offset % sector_size();
+		auto n = min(size, sector_size() - pos);
+		auto sec = file_sector(first_map, offset / sector_size(), true);
+		memcpy(d->sector_ptr(sec) + pos, data, n);
+		data += n; offset += n; size -= n;
+	}
 }
 
 sparta_dos::sparta_dos_dir::sparta_dos_dir(sparta_dos_file * file) : f(file) {
@@ -126,8 +286,9 @@ sparta_dos::sparta_dos_dir::~sparta_dos_dir() {
 
 filesystem::dir * sparta_dos::open_dir(disk::sector_num sector)
 {
-	auto file = new sparta_dos_file(*this, sector, 32000, false);
-	return new sparta_dos_dir(file);
+	// Real size of the directory is stored in its header entry, which is read first.
+	auto file = new (memory()) sparta_dos_file(*this, sector, dir_entry_size);
+	return new (memory()) sparta_dos_dir(file);
 }
 
 filesystem::dir * sparta_dos::root_dir()
@@ -137,12 +298,29 @@ filesystem::dir * sparta_dos::root_dir()
 
 bool sparta_dos::sparta_dos_dir::at_end()
 {
-	return f->eof() || buf[0] == FLAG_DIR_END;
+	return buf[0] == FLAG_DIR_END;
 }
 
 void sparta_dos::sparta_dos_dir::next()
 {
-	((filesystem::file *)f)->read(buf, dir_entry_size);
+	if (f->eof()) {
+		buf[0] = FLAG_DIR_END;
+	} else {
+		f->read_bytes(buf, dir_entry_size);
+	}
+}
+
+// Position is the offset of entry in directory file.
+
+size_t sparta_dos::sparta_dos_dir::tell()
+{
+	return f->byte_pos - dir_entry_size;
+}
+
+void sparta_dos::sparta_dos_dir::seek(size_t pos)
+{
+	f->seek(pos);
+	next();
 }
 
 filesystem::dir * sparta_dos::sparta_dos_dir::open_dir()
@@ -162,40 +340,8 @@ bool  sparta_dos::sparta_dos_dir::is_deleted()
 
 std::string sparta_dos::sparta_dos_dir::name()
 {
-	char t[4 * 24];
-	bool inverse = false;
-	byte * filename = buf + dir_filename;
-
-	size_t p = 0, non_space = 0;
-	for (size_t i = 0; i < 11; i++) {
-		if (i == 8 && !inverse) {
-			p = non_space;
-			t[p++] = '.';
-		}
-		byte b = filename[i];
-		if (b >= 128) {
-			if (!inverse) {
-				inverse = true;
-				t[p++] = '\\'; t[p++] = 'i';
-			}
-			b = b & 0x7f;
-		} else {
-			if (inverse) {
-				t[p++] = '\\'; t[p++] = 'i';
-				inverse = false;
-			}
-		}
-		if (b < 32 || b == 123 || b >= 125) {
-			const char * hex_digit = "0123456789ABCDEF";
-			t[p++] = '\\'; t[p++] = 'x'; t[p++] = hex_digit[b >> 4]; t[p++] = hex_digit[b & 0xf];
-		} else {
-			if (b == ' ' || b == '\\') t[p++] = '\\';
-			char c = char(b);
-			t[p++] = c;
-		}
-		if (b != ' ' || inverse) non_space = p;
-	}
-	t[non_space] = 0;
+	char t[atascii_name_size(11)];
+	atascii_decode_name(buf + dir_filename, 11, 8, t);
 	return string(t);
 }
 
@@ -213,39 +359,141 @@ size_t sparta_dos::sparta_dos_dir::sec_size()
 {
 	auto sec_size = f->filesystem().sector_size();
 	auto sz = size();
-	return sz;
 	return (sz + (sec_size-1)) / sec_size;
 }
 
+// Rest of the directory is read at once and decoded from memory.
+
+void sparta_dos::sparta_dos_dir::snapshot(std::vector<entry> & entries)
+{
+	if (at_end()) return;
+
+	auto sec_size = f->filesystem().sector_size();
+	auto start = tell();
+	vector<byte> data(dir_entry_size + f->size() - f->byte_pos);
+	memcpy(data.data(), buf, dir_entry_size);
+	f->read_bytes(data.data() + dir_entry_size, data.size() - dir_entry_size);
+
+	for (size_t i = 0; i + dir_entry_size <= data.size(); i += dir_entry_size) {
+		auto b = &data[i];
+		if (b[0] == FLAG_DIR_END) break;
+		entry e;
+		set_entry_name(e, b + dir_filename, 11, 8);
+		e.flags = b[0];
+		e.is_dir = (b[0] & FLAG_SUBDIRECTORY) != 0;
+		e.is_deleted = (b[0] & FLAG_DELETED) != 0;
+		e.first_sector = peek_word(b, dir_first_sector);
+		e.size = peek_word(b, dir_file_size) + 0x10000 * b[dir_file_size + 2];
+		e.sec_size = (e.size + sec_size - 1) / sec_size;
+		e.pos = start + i;
+		entries.push_back(e);
+	}
+	buf[0] = FLAG_DIR_END;
+}
+
 filesystem::file * sparta_dos::sparta_dos_dir::open_file()
 {
-	return new sparta_dos_file(f->filesystem(), first_sector(), size(), false);
+	auto & fs = f->filesystem();
+	return new (fs.memory()) sparta_dos_file(fs, first_sector(), size());
+}
+
+filesystem::file * sparta_dos::sparta_dos_dir::create_file(char * name)
+{
+	auto & fs = f->filesystem();
+	auto dir_map = f->first_sector();
+
+	auto first_map = fs.alloc_sector(alloc_data);
+	fs.d->init_sector(first_map);
+	auto entry = fs.add_entry(dir_map, FLAG_IN_USE, first_map, 0, name);
+	return new (fs.memory()) sparta_dos_file(fs, first_map, dir_map, entry);
+}
+
+filesystem::dir * sparta_dos::sparta_dos_dir::create_dir(char * name)
+{
+	auto & fs = f->filesystem();
+	auto dir_map = f->first_sector();
+
+	auto first_map = fs.alloc_sector(alloc_dir);
+	fs.d->init_sector(first_map);
+
+	byte header[dir_entry_size];
+	memset(header, 0, sizeof(header));
+	header[0] = FLAG_IN_USE | FLAG_SUBDIRECTORY;
+	poke_word(header, dir_first_sector, word(dir_map));
+	poke_size(header + dir_file_size, dir_entry_size);
+	memcpy(header + dir_filename, name, 11);
+	fs.file_write_at(first_map, 0, header, dir_entry_size);
+
+	fs.add_entry(dir_map, FLAG_IN_USE | FLAG_SUBDIRECTORY, first_map, dir_entry_size, name);
+	return fs.open_dir(first_map);
+}
+
+sparta_dos::sparta_dos_file::sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, size_t size) :
+	fs(fs),
+	first_map(first_map),
+	writing(false),
+	byte_size(size),
+	byte_pos(0),
+	extents(fs.memory()),
+	ext(0),
+	ext_offset(0),
+	data_map(fs.memory()),
+	pos(0),
+	data_sectors(fs.memory())
+{
+	read_map();
 }
 
-sparta_dos::sparta_dos_file::sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, size_t size, bool writing) :
+sparta_dos::sparta_dos_file::sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, disk::sector_num dir_map, size_t dir_entry) :
 	fs(fs),
 	first_map(first_map),
-	writing(writing),
-	byte_size(size)
-{
-	data_buf = new byte[fs.d->sector_size()];
-	map_buf = new byte[fs.d->sector_size()];
-
-	if (first_map) {
-		fs.read_sector(first_map, map_buf);
-		sector_map = first_map;
-		map_offset = 2;
-		sector = sector_next();
-		if (sector) {
-			fs.read_sector(sector, data_buf);
+	writing(true),
+	byte_size(0),
+	byte_pos(0),
+	extents(fs.memory()),
+	ext(0),
+	ext_offset(0),
+	data_map(fs.memory()),
+	pos(0),
+	data_sectors(fs.memory()),
+	dir_map(dir_map),
+	dir_entry(dir_entry)
+{
+	data_buf = arena_buffer(fs.memory(), fs.d->sector_size());
+}
+
+void sparta_dos::sparta_dos_file::read_map()
+/*
+Sector map:
+
+	0..1  next sector map (0 if this is the last one)
+	2..3  previous sector map
+	4..   data sectors (2 bytes each)
+*/
+{
+	auto per_map = fs.map_entries();
+	disk::sector_num maps = 0;
+
+	for (auto map = first_map; map != 0; map = fs.d->read_word(map, 0)) {
+		if (map > fs.sector_count() || ++maps > fs.sector_count()) throw "Invalid SpartaDOS sector map.";
+		auto p = fs.d->sector_ptr(map) + 4;
+		for (size_t i = 0; i < per_map; i++, p += 2) {
+			disk::sector_num sec = peek_word(p, 0);
+			if (sec > fs.sector_count()) throw "Invalid SpartaDOS sector map.";
+			if (!extents.empty()) {
+				auto & e = extents.back();
+				if ((e.sector == 0 && sec == 0) || (e.sector != 0 && e.sector + e.count == sec)) {
+					e.count++;
+					continue;
+				}
+			}
+			extents.push_back({ sec, 1 });
 		}
-	} else {
-		sector = 0;
 	}
-	byte_pos = 0;
-	pos = 0;
-}
 
+	// unused entries at the end of last map
+	if (!extents.empty() && extents.back().sector == 0) extents.pop_back();
+}
 
 sparta_dos & sparta_dos::sparta_dos_file::filesystem()
 {
@@ -254,7 +502,7 @@ sparta_dos & sparta_dos::sparta_dos_file::filesystem()
 
 size_t sparta_dos::sparta_dos_file::size()
 {
-	return 0;
+	return byte_size;
 }
 
 void sparta_dos::sparta_dos_file::set_size(size_t size)
@@ -264,40 +512,49 @@ void sparta_dos::sparta_dos_file::set_size(size_t size)
 
 sparta_dos::sparta_dos_file::~sparta_dos_file()
 {
-	delete[] map_buf;
-	delete[] data_buf;
+	if (writing) close();
 }
 
-void sparta_dos::sparta_dos_file::write_sec(disk::sector_num next)
+void sparta_dos::sparta_dos_file::write_sec()
 {
-/*
-	auto p = fs.sector_size();
-	buf[--p] = byte(pos);
-	buf[--p] = next & 0xff;
-	buf[--p] = byte((file_no << 2) + (next >> 8));
-	fs.write_sector(sector, buf);
-	sector = next;
-	sec_cnt++;
+	// Data sectors are allocated sequentially, so the file is stored in one run on empty disk.
+
+	memset(data_buf + pos, 0, fs.sector_size() - pos);
+	auto sec = fs.alloc_sector(alloc_data);
+	fs.write_sector(sec, data_buf);
+	data_sectors.push_back(sec);
 	pos = 0;
-*/
 }
 
-bool sparta_dos::sparta_dos_file::sector_end()
+void sparta_dos::sparta_dos_file::close()
+/*
+Purpose:
+	Write sector maps of the file and its size into the directory.
+	First sector map has been allocated when the file was created, others are allocated in one run after the data.
+*/
 {
-	return pos == fs.sector_size();
-}
+	if (pos > 0) write_sec();
 
-disk::sector_num sparta_dos::sparta_dos_file::sector_next()
-{
-	map_offset += 2;
-	if (map_offset == fs.sector_size()) {
-		map_offset = 4;
-		sector_map = peek_word(map_buf, 0);
-		if (sector_map == 0) return 0;
+	auto per_map = fs.map_entries();
+	size_t map_count = max<size_t>(1, (data_sectors.size() + per_map - 1) / per_map);
+
+	vector<disk::sector_num> maps(map_count);
+	maps[0] = first_map;
+	for (size_t i = 1; i < map_count; i++) {
+		maps[i] = fs.alloc_sector(alloc_data);
 	}
 
-	disk::sector_num x = peek_word(map_buf, map_offset);
-	return x;
+	for (size_t i = 0; i < map_count; i++) {
+		auto s = fs.d->init_sector(maps[i]);
+		s.dpoke(0, word(i + 1 < map_count ? maps[i + 1] : 0));
+		s.dpoke(2, word(i > 0 ? maps[i - 1] : 0));
+		for (size_t j = 0; j < per_map && i * per_map + j < data_sectors.size(); j++) {
+			s.dpoke(4 + j * 2, word(data_sectors[i * per_map + j]));
+		}
+	}
+
+	fs.set_entry_size(dir_map, dir_entry, byte_size);
+	writing = false;
 }
 
 disk::sector_num sparta_dos::sparta_dos_file::first_sector()
@@ -310,61 +567,182 @@ bool sparta_dos::sparta_dos_file::eof()
 	return byte_pos == byte_size;
 }
 
-byte sparta_dos::sparta_dos_file::read()
+void sparta_dos::sparta_dos_file::seek(size_t new_pos)
 {
-	if (pos == fs.sector_size()) {
-		auto next = sector_next();
-		if (!next) throw("EOF");
-		sector = next;
-		pos = 0;
-		fs.read_sector(sector, data_buf);
+	auto sec_size = fs.sector_size();
+	byte_pos = min(new_pos, byte_size);
+	ext = 0;
+	ext_offset = byte_pos;
+	while (ext < extents.size() && ext_offset >= extents[ext].count * sec_size) {
+		ext_offset -= extents[ext].count * sec_size;
+		ext++;
 	}
+}
+
+size_t sparta_dos::sparta_dos_file::size_hint()
+{
+	return byte_size;
+}
+
+// Extent is a run of consecutive sectors, its data are copied at once.
+
+size_t sparta_dos::sparta_dos_file::read_span(byte * data, size_t size)
+{
+	size = min(size, byte_size - byte_pos);
+	if (size == 0) return 0;
+	if (ext == extents.size()) throw("EOF");
 
-	if (byte_pos == byte_size) throw("EOF");
+	auto & e = extents[ext];
+	auto len = e.count * fs.sector_size();
+	auto n = min(size, len - ext_offset);
+	if (e.sector) {
+		memcpy(data, fs.d->sector_ptr(e.sector) + ext_offset, n);
+	} else {
+		memset(data, 0, n);
+	}
+	ext_offset += n;
+	if (ext_offset == len) {
+		ext++;
+		ext_offset = 0;
+	}
+	byte_pos += n;
+	return n;
+}
 
-	byte_pos++;
-	return data_buf[pos++];
+size_t sparta_dos::sparta_dos_file::pread(size_t offset, byte * data, size_t size)
+{
+	if (data_map.empty()) {
+		auto sec_size = fs.sector_size();
+		size_t file_pos = 0;
+		for (auto & e : extents) {
+			if (file_pos >= byte_size) break;
+			auto len = min(size_t(e.count) * sec_size, byte_size - file_pos);
+			data_map.push_back({ file_pos, len, e.sector });
+			file_pos += len;
+		}
+	}
+	return fs.read_extents(data_map, offset, data, size);
 }
 
-void sparta_dos::sparta_dos_file::write(byte b)
+size_t sparta_dos::sparta_dos_file::write_span(const byte * data, size_t size)
 {
+	auto n = min(size, fs.sector_size() - pos);
+	memcpy(data_buf + pos, data, n);
+	pos += n;
+	byte_size += n;
+	if (pos == fs.sector_size()) write_sec();
+	return n;
 }
 
 /*
-Volume table of contents(VTOC)
+Bitmap
 
-Sector 360 is the VTOC. It has this structure:
+Bitmap of free sectors occupies BITMAP_SECTOR_COUNT sectors starting at BITMAP_SECTOR.
+The high-order bit of first byte corresponds to (nonexistent) sector 0, the next bit to sector 1 and so on.
+Bit is set to 1 if the sector is free.
 
-Byte 0 : Directory type(always 0)
-Byte 1 - 2 : Maximum sector number (always 02C5, which is incorrect given that this equals 709 and the actual maximum sector number used by the FMS is 719.
-Due to this error, this value is ignored.)
-Byte 3 - 4 : Number of sectors available (starts at 709 and changes as sectors are allocated or deallocated)
-Byte 10 - 99 : Bitmap showing allocation of sectors.The high - order bit of byte 10 corresponds to(the nonexistent) sector 0 (so it is unused),
-the next - lower bit corresponds to sector 1, and so on through sector 7 for the low - order bit of byte 10,
-then sector 8 for the high - order bit of byte 11, and so on.These are set to 1 if the sector is available, and 0 if it is in use.
+Data and directories are searched for from separate positions (DATA_SECTOR_SEARCH, DIR_SECTOR_SEARCH),
+so that directories stay together and file data are not fragmented by them.
 */
 
-const size_t boot_size = 3;
-
-
 void sparta_dos::vtoc_format()
 {
+	auto count = sector_count();
+	auto bits = sector_size() * 8;
+
+	bitmap_sec = 4;
+	bitmap_sec_count = (count + 1 + bits - 1) / bits;
+	if (bitmap_sec_count > 255) throw "Disk too large for SpartaDOS bitmap.";
+
+	vtoc_buf = arena_buffer(memory(), bitmap_sec_count * sector_size());
+	memset(vtoc_buf, 0, bitmap_sec_count * sector_size());
+
+	auto first_free = bitmap_sec + bitmap_sec_count;
+	for (auto sec = first_free; sec <= count; sec++) {
+		vtoc_buf[sec / 8] |= 128 >> (sec & 7);
+	}
+	free_count = count - first_free + 1;
+	data_search = first_free;
+	dir_search = first_free;
+	vtoc_dirty = true;
+
+	auto s = d->get_sector(1);
+	s.poke(1, 3);								// boot sectors
+	s.dpoke(2, 0x3000);							// load address
+	s.poke(6, 0x4C);							// JMP $3080
+	s.dpoke(7, 0x3080);
+	s.dpoke(TOTAL_SECTOR_COUNT, word(count));
+	s.poke(BITMAP_SECTOR_COUNT, byte(bitmap_sec_count));
+	s.dpoke(BITMAP_SECTOR, word(bitmap_sec));
+	s.set(DISK_VOLUME_NAME, 8, ' ');
+	s.poke(SECTOR_SIZE_CODE, sector_size() == 128 ? 0x80 : byte(sector_size() >> 9));
+	s.poke(FS_VERSION, SPARTA_VERSION);
 }
 
 void sparta_dos::vtoc_write()
 {
+	if (!vtoc_dirty) return;
+
+	for (size_t i = 0; i < bitmap_sec_count; i++) {
+		write_sector(bitmap_sec + i, vtoc_buf + i * sector_size());
+	}
+
+	auto s = d->get_sector(1);
+	s.dpoke(FREE_SECTOR_COUNT, word(free_count));
+	s.dpoke(DATA_SECTOR_SEARCH, word(data_search));
+	s.dpoke(DIR_SECTOR_SEARCH, word(dir_search));
+	vtoc_dirty = false;
 }
 
 void sparta_dos::vtoc_read()
 {
+	auto s = d->get_sector(1);
+	bitmap_sec = s.dpeek(BITMAP_SECTOR);
+	bitmap_sec_count = s.peek(BITMAP_SECTOR_COUNT);
+	data_search = s.dpeek(DATA_SECTOR_SEARCH);
+	dir_search = s.dpeek(DIR_SECTOR_SEARCH);
+
+	if (bitmap_sec < 1 || bitmap_sec + bitmap_sec_count - 1 > sector_count()) throw "Invalid SpartaDOS bitmap.";
+
+	vtoc_buf = arena_buffer(memory(), bitmap_sec_count * sector_size());
+	for (size_t i = 0; i < bitmap_sec_count; i++) {
+		read_sector(bitmap_sec + i, vtoc_buf + i * sector_size());
+	}
+	vtoc_dirty = false;
 }
 
-disk::sector_num sparta_dos::alloc_sector()
+disk::sector_num sparta_dos::alloc_sector(alloc_area area)
 /*
 Purpose:
 	Find free sector on the disk and return it's number.
-	Mark the sector as used and decrement number of free sectors in the VTOC table.
+	Mark the sector as used and decrement number of free sectors.
 */
 {
-	return 0;
+	if (!vtoc_buf) vtoc_read();
+
+	auto & search = (area == alloc_dir) ? dir_search : data_search;
+	disk::sector_num last = min<disk::sector_num>(sector_count(), bitmap_sec_count * sector_size() * 8 - 1);
+
+	// Search from the last position first, then from the beginning of the disk
+
+	for (int pass = 0; pass < 2; pass++) {
+		disk::sector_num sec = (pass == 0) ? max<disk::sector_num>(search, 1) : 1;
+		while (sec <= last) {
+			byte b = vtoc_buf[sec / 8];
+			if (b == 0) {
+				sec = (sec | 7) + 1;
+				continue;
+			}
+			byte bit = 128 >> (sec & 7);
+			if (b & bit) {
+				vtoc_buf[sec / 8] = b ^ bit;
+				free_count--;
+				search = sec + 1;
+				vtoc_dirty = true;
+				return sec;
+			}
+			sec++;
+		}
+	}
+	throw "disk full";
 }
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "filesystem.h"
+#include "file_io.h"
+#include <vector>
 
 class sparta_dos : public filesystem
 {
@@ -20,24 +22,33 @@ public:
 
 	std::string name() override;
 	const property * properties();
+	static const property * property_table();
 	disk::sector_num free_sector_count() override;
+	disk::sector_num file_sectors(size_t size) override;
+	size_t dir_entry_bytes(const char * name) override;
+	disk::sector_num dir_sectors(size_t bytes, bool root) override;
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
+	void install_boot(const std::string & filename) override;
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
 
-	class sparta_dos_file : public filesystem::file
+	class sparta_dos_dir;
+
+	class sparta_dos_file : public file_io<sparta_dos_file>
 	{
 		friend class sparta_dos_dir;
+		friend class file_io<sparta_dos_file>;
 	public:
 
-		sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, size_t size, bool writing);
+		sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, size_t size);
+		sparta_dos_file(sparta_dos & fs, disk::sector_num first_map, disk::sector_num dir_map, size_t dir_entry);	// new file for writing
 		~sparta_dos_file();
 
 		bool eof() override;
-		byte read() override;
-		void write(byte b) override;
+		size_t pread(size_t offset, byte * data, size_t size) override;
+		size_t size_hint() override;
 		disk::sector_num first_sector() override;
 
 		sparta_dos & filesystem();
@@ -45,29 +56,43 @@ public:
 		size_t size();
 
 		void set_size(size_t size);
+		void seek(size_t pos);
 
 	private:
-		void write_sec(disk::sector_num next);
-		bool sector_end();
-		disk::sector_num sector_next();
+		size_t read_span(byte * data, size_t size);
+		size_t write_span(const byte * data, size_t size);
+
+		void read_map();
+		void write_sec();
+		void close();
 
 		sparta_dos & fs;
 
 		disk::sector_num first_map;
-		disk::sector_num sector_map;
-		byte * map_buf;
-
-		size_t		map_offset;				// number of sector in sector map (initialized to 2 for first sector)
-	
-		// current position
-		disk::sector_num sector;
-		size_t pos;
-		byte * data_buf;
-
 		bool writing;
 
 		size_t byte_size;					// size in bytes
 		size_t byte_pos;
+
+		// reading
+		// Whole sector map chain is decoded when the file is opened, consecutive sectors are joined into extents.
+		// Data are then copied directly from the disk buffer.
+
+		struct extent {
+			disk::sector_num sector;		// 0 for sectors missing in the map
+			disk::sector_num count;
+		};
+		arena_vector<extent> extents;
+		size_t ext;							// current extent
+		size_t ext_offset;					// offset in bytes in current extent
+		arena_vector<filesystem::data_extent> data_map;	// extents with their position in file, for pread
+
+		// writing
+		arena_buffer data_buf;
+		size_t pos;
+		arena_vector<disk::sector_num> data_sectors;	// sector maps are written when the file is closed
+		disk::sector_num dir_map;			// directory containing the file
+		size_t dir_entry;					// offset of the entry in directory
 	};
 
 	class sparta_dos_dir : public filesystem::dir
@@ -84,6 +109,11 @@ public:
 		bool is_dir() override;
 		bool is_deleted() override;
 		dir * open_dir() override;
+		file * create_file(char * name) override;
+		dir * create_dir(char * name) override;
+		size_t tell() override;
+		void seek(size_t pos) override;
+		void snapshot(std::vector<entry> & entries) override;
 
 	private:
 		disk::sector_num first_sector();
@@ -92,30 +122,42 @@ public:
 	};
 
 	filesystem::dir * root_dir() override;
-	//filesystem::file * create_file(char * name) override;
 	dir * open_dir(disk::sector_num sector);
 
 protected:
 
 	// DIR
 	void dir_format();
-	disk::sector_num dir_sector;		// first sector of dir
+	size_t add_entry(disk::sector_num dir_map, byte flags, disk::sector_num first_map, size_t size, const char * name);
+	void set_entry_size(disk::sector_num dir_map, size_t entry, size_t size);
+	disk::sector_num dir_sector;		// sector map of main dir
 	disk::sector_num free_count;
-	byte * dir_buf;
 
-	// VTOC
+	// Random access to file data through the sector map (used for directories)
 
-	inline void switch_sector_used(disk::sector_num sec) {
-		vtoc_buf[10 + sec / 8] ^= (128 >> (sec & 7));
+	size_t map_entries() {
+		return (sector_size() - 4) / 2;
 	}
+	disk::sector_num file_sector(disk::sector_num first_map, size_t index, bool alloc);
+	void file_read_at(disk::sector_num first_map, size_t offset, byte * data, size_t size);
+	void file_write_at(disk::sector_num first_map, size_t offset, const byte * data, size_t size);
+
+	// BITMAP
+
+	enum alloc_area {
+		alloc_data,					// file data and sector maps
+		alloc_dir					// directories
+	};
 
-	virtual disk::sector_num alloc_sector();
-	virtual void vtoc_format();
-	virtual void vtoc_read();
-	virtual void vtoc_write();
+	disk::sector_num alloc_sector(alloc_area area);
+	void vtoc_format();
+	void vtoc_read();
+	void vtoc_write();
 
 	disk::sector_num bitmap_sec;
 	size_t bitmap_sec_count;
-	byte * vtoc_buf;
-	int vtoc_dirty;
+	arena_buffer vtoc_buf;				// bitmap, loaded when first sector is allocated
+	bool vtoc_dirty;
+	disk::sector_num data_search;		// allocation starts searching at these sectors
+	disk::sector_num dir_search;
 };
@@ -18,7 +18,7 @@ disk::sector_num xdos::get_dos_first_sector()
 	return read_word(1, X_BOOT_FILE_LO, X_BOOT_FILE_HI);
 }
 
-const filesystem::property * xdos::properties()
+const filesystem::property * xdos::property_table()
 {
 	static const filesystem::property props[] = {
 
@@ -38,10 +38,15 @@ const filesystem::property * xdos::properties()
 	return props;
 }
 
-bool xdos::detect(disk * d)
+const filesystem::property * xdos::properties()
+{
+	return property_table();
+}
+
+int xdos::detect(const detect_info & info)
 {
-	auto s = d->get_sector(1);
-	return s->buf[0] == 0x58 && s->buf[X_BOOT_FILE_LO-1] == 0xA0 && s->buf[X_BOOT_FILE_HI-1] == 0xA2;
+	auto b = info.boot;
+	return (b[0] == 0x58 && b[X_BOOT_FILE_LO-1] == 0xA0 && b[X_BOOT_FILE_HI-1] == 0xA2) ? detect_certain : detect_none;
 }
 
 xdos::xdos(disk * d) : dos_IIplus(d)
@@ -50,7 +55,7 @@ xdos::xdos(disk * d) : dos_IIplus(d)
 
 filesystem * xdos::format(disk * d)
 {
-	auto fs = new xdos(d);
+	auto fs = new (d->memory()) xdos(d);
 	fs->vtoc_format(1023, true);
 	return fs;
 }
@@ -58,9 +58,10 @@ public:
 
 	std::string name();
 	const property * properties();
+	static const property * property_table();
 
 	static filesystem * format(disk * d);
-	static bool detect(disk * d);
+	static int detect(const detect_info & info);
 
 	disk::sector_num get_dos_first_sector() override;
 	void set_dos_first_sector(disk::sector_num sector) override;
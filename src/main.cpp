@@ -2,10 +2,19 @@
 #include <iomanip>
 #include <fstream>
 #include <vector>
+#include <set>
 #include <sstream>
 #include <memory>
 #include <cassert>
+#include <thread>
+#include <atomic>
+#include <chrono>
 #include "../libatr/libatr.h"
+#include "../libatr/probe.h"
+#include "../libatr/manifest.h"
+#include "../libatr/prefetch.h"
+#include "../libatr/batch_load.h"
+#include "../libatr/host_writer.h"
 
 #ifdef _WIN32
 #include <direct.h>
@@ -56,16 +65,10 @@ filename [atarifilename]
 --- atarifilename
 BIN filename atarifilename
 DOS filename atarifilename -- will install the file as DOS.SYS
+TXT filename atarifilename -- UTF-8 text file, converted to ATASCII
 
    */
 
-enum class file_format {
-	empty,
-	bin,
-	dos,
-	dir
-};
-
 bool is_reserved_filename(const string filename)
 {
 	const char * names[] = { "con", "aux", "nul", "prn",
@@ -79,119 +82,89 @@ bool is_reserved_filename(const string filename)
 	return false;
 }
 
-disk * pack(const string dir_filename)
-{
+// Create the disk in two phases: after the filesystem is formatted, the space needed by all files is planned,
+// then the files are written. Host files are read in the background, ahead of the file being written.
 
+disk * pack(manifest & m)
+{
 	std::vector<filesystem::dir *> dir_stack;
-	ifstream index(dir_filename);
 
 	size_t sector_size = 128;
 	disk::sector_num sector_count = 1040;
-	string dos_type;
 
 	disk * d = nullptr;
+	unique_ptr<disk::writer> lock;		// the disk is modified only by this thread while packing
 	filesystem * fs = nullptr;
-	const filesystem::property * prop;
-	filesystem::dir * dir = nullptr;;
-
-	while (!index.eof()) {
-		string line;
-		getline(index, line);
-		if (line.size() == 0) continue;
-		if (line[0] == ';') continue;
-
-		istringstream s(line);
-
-		//parse file name or command
+	filesystem::dir * dir = nullptr;
 
-		string filename;
-
-		int nesting = 0;
-
-		s >> filename;
-
-		while (filename == "|") {
-			nesting++;
-			s >> filename;
-		}
+	vector<string> paths;
+	for (auto & c : m.commands) {
+		if (!c.path.empty()) paths.push_back(c.path);
+	}
+	prefetch host_files(paths);
+	vector<byte> data;
 
-		if (nesting > dir_stack.size()) {
-			throw "invalid dir nesting";
-		}
+	for (auto & c : m.commands) {
+		m.error_line = c.line;
 
-		while (nesting < dir_stack.size()) {
+		while (c.nesting < dir_stack.size()) {
 			delete dir;
 			dir = dir_stack.back();
 			dir_stack.pop_back();
-			change_dir("..");
 		}
 
-		file_format fformat = file_format::bin;
+		if (c.type != manifest::command_type::disk && !d) {
+			d = new disk(sector_size, sector_count);
+			lock.reset(new disk::writer(*d));
+		}
 
-		if (filename == "DISK") {
-			s >> sector_count >> sector_size;
+		switch (c.type) {
+		case manifest::command_type::disk:
+			sector_count = c.sector_count;
+			sector_size = c.sector_size;
 			continue;
 
-		} else if (filename == "FORMAT") {
-			s >> dos_type;
-			if (!d) d = new disk(sector_size, sector_count);
-			fs = install_filesystem(d, dos_type);
+		case manifest::command_type::format:
+			fs = c.fs->format(d);
 			dir = fs->root_dir();
+			m.plan(fs);
 			continue;
 
-		} else if (filename == "BOOT") {
-			if (!d) d = new disk(sector_size, sector_count);
-			s >> filename;
-			d->install_boot(filename);
+		case manifest::command_type::boot:
+			if (fs) {
+				fs->install_boot(c.filename.str());
+			} else {
+				d->install_boot(c.filename.str());
+			}
 			continue;
 
-		} else if (fs && (prop = fs->find_property(filename))) {
-			string value;
-			getline(s, value);
-			fs->set_property(prop, value);
-			continue;
-		} else if (filename == "/") {
-			fformat = file_format::dir;
-			s >> filename;
-			change_dir(filename.c_str());
-		}  else if (filename == "---") {
-			fformat = file_format::empty;
-		} else {
-			if (filename == "BIN") {
-				fformat = file_format::bin;
-				s >> filename;
-			} else if (filename == "DOS") {
-				fformat = file_format::dos;
-				s >> filename;
+		case manifest::command_type::property:
+			if (c.prop->size > 2) {
+				fs->set_property(c.prop, c.text.str());
 			} else {
-				fformat = file_format::bin;
+				fs->set_property(c.prop, c.value);
 			}
-		}
-
-		// parse atari name
+			continue;
 
-		char name[12];
-		if (!filesystem::format_atari_name(s, name, 8, 3)) {
-			istringstream fs(filename);
-			filesystem::format_atari_name(fs, name, 8, 3);
+		default:
+			break;
 		}
 
-		for (auto i = 0; i < nesting; i++) cout << " | ";
+		auto filename = c.filename.str();
+
+		for (size_t i = 0; i < c.nesting; i++) cout << " | ";
 
-		if (fformat == file_format::dir) {
+		if (c.type == manifest::command_type::dir) {
 			dir_stack.push_back(dir);
-			dir = dir->create_dir(name);
+			dir = dir->create_dir(c.name);
 			cout << filename << "/\n";
 		} else {
-			auto file = dir->create_file(name);
-			if (fformat != file_format::empty) {
-				if (filename.size() == 0) {
-					throw "no filename";
-				}
+			auto file = dir->create_file(c.name);
+			if (c.format != manifest::file_format::empty) {
 				cout << filename << "\n";
-				file->import(filename);
-				if (fformat == file_format::dos) {
-					auto pos = file->first_sector();
+				host_files.next(data);
+				file->import(data.data(), data.size(), c.format == manifest::file_format::txt);
+				if (c.format == manifest::file_format::dos) {
 					fs->set_dos_first_sector(file->first_sector());
 				}
 			}
@@ -199,62 +172,92 @@ disk * pack(const string dir_filename)
 		}
 	}
 
+	if (!d) {
+		d = new disk(sector_size, sector_count);
+	}
+
 	while (dir_stack.size()) {
 		delete dir;
 		dir = dir_stack.back();
 		dir_stack.pop_back();
-		change_dir("..");
 	}
 	delete dir;
 
 	delete fs;
+	m.error_line = 0;
 	return d;
 }
 
-void unpack_dir(filesystem::dir * dir, ofstream & atrdir, int nesting, disk::sector_num dos_first_sector)
+disk * pack(const string dir_filename)
+{
+	manifest m;
+	try {
+		m.load(dir_filename);
+		return pack(m);
+	} catch (const char *) {
+		if (m.error_line) cerr << dir_filename << " line " << m.error_line << ":\n";
+		throw;
+	}
+}
+
+// Files with extension from text_ext are converted to UTF-8 text.
+
+bool is_text_file(const string & name, const set<string> & text_ext)
+{
+	auto p = name.find_last_of('.');
+	return p != string::npos && text_ext.count(name.substr(p + 1)) > 0;
+}
+
+void unpack_dir(filesystem * fs, filesystem::dir * dir, ofstream & atrdir, int nesting, disk::sector_num dos_first_sector, const set<string> & text_ext, ostream & out)
 {
 	int name_idx = 1;
-	for (; !dir->at_end(); dir->next()) {
+	for (auto & e : fs->snapshot_dir(dir)) {
 
-		if (dir->is_deleted()) continue;
+		if (e.is_deleted) continue;
 
-		string name = dir->name();
+		string name = e.name;
 		
 		for (int i = 0; i < nesting; i++) {
-			cout << " | ";
+			out << " | ";
 			if (atrdir.is_open()) {
 				atrdir << " | ";
 			}
 		}
 
-		cout << std::setfill(' ') << std::setw(12) << std::left << name  << " ";
+		out << std::setfill(' ') << std::setw(12) << std::left << name  << " ";
 
-		if (dir->is_dir()) {
-			cout << " /\n";
+		if (e.is_dir) {
+			out << " /\n";
+			dir->seek(e.pos);
 			auto subdir = dir->open_dir();
 			if (atrdir.is_open()) {
 				atrdir << "/ " << name << "\n";
 				make_dir(name);
 				change_dir(name.c_str());
 			}
-			unpack_dir(subdir, atrdir, nesting + 1, dos_first_sector);
+			unpack_dir(fs, subdir, atrdir, nesting + 1, dos_first_sector, text_ext, out);
 			delete subdir;
 			if (atrdir.is_open()) {
 				change_dir("..");
 			}
 		} else {
-			cout << std::right << std::setw(7) << dir->size() << std::setw(4) << dir->sec_size() << "\n";
+			out << std::right << std::setw(7) << e.size << std::setw(4) << e.sec_size << "\n";
 
 			if (atrdir.is_open()) {
-				if (dir->size() == 0) {
+				if (e.size == 0) {
 					atrdir << "--- ";
 					atrdir << name;
 				} else {
 
+					dir->seek(e.pos);
 					auto file = dir->open_file();
 
+					bool text = false;
 					if (file->first_sector() == dos_first_sector) {
 						atrdir << "DOS ";
+					} else if (is_text_file(name, text_ext)) {
+						atrdir << "TXT ";
+						text = true;
 					}
 
 					if (name.find('\\') != string::npos) {
@@ -270,7 +273,7 @@ void unpack_dir(filesystem::dir * dir, ofstream & atrdir, int nesting, disk::sec
 						atrdir << name;
 					}
 
-					file->save(name);
+					file->save(name, text);
 					delete file;
 				}
 				atrdir << "\n";
@@ -279,16 +282,16 @@ void unpack_dir(filesystem::dir * dir, ofstream & atrdir, int nesting, disk::sec
 	}
 }
 
-void unpack(filesystem * fs, const string & dir_file)
+void unpack(filesystem * fs, const string & dir_file, const set<string> & text_ext = set<string>(), ostream & out = cout)
 {
 	ofstream atrdir;
 	if (!dir_file.empty()) {
 		atrdir.open(dir_file);
 	}
 
-	cout << "DISK " << fs->sector_count() << " " << fs->sector_size() << "\n";
-	cout << "FORMAT " << fs->name() << "\n";
-	cout << "\n";
+	out << "DISK " << fs->sector_count() << " " << fs->sector_size() << "\n";
+	out << "FORMAT " << fs->name() << "\n";
+	out << "\n";
 
 	if (atrdir.is_open()) {
 		atrdir << "DISK " << fs->sector_count() << " " << fs->sector_size() << "\n";
@@ -308,63 +311,253 @@ void unpack(filesystem * fs, const string & dir_file)
 
 	auto dir = fs->root_dir();
 
-	unpack_dir(dir, atrdir, 0, dos_first_sector);
+	unpack_dir(fs, dir, atrdir, 0, dos_first_sector, text_ext, out);
 
 	delete dir;
 
-	cout << "\n" << "free sectors: " << fs->free_sector_count() << "\n";
+	out << "\n" << "free sectors: " << fs->free_sector_count() << "\n";
 
 }
 
+string json_string(const string & s)
+{
+	ostringstream o;
+	o << '"';
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			o << '\\' << c;
+		} else if (c < 0x20) {
+			o << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec;
+		} else {
+			o << c;
+		}
+	}
+	o << '"';
+	return o.str();
+}
+
+// Print one JSON line per image, errors are reported in the line too, so one bad file does not stop the batch.
+
+void info(const string & filename)
+{
+	cout << "{\"file\":" << json_string(filename);
+	try {
+		auto i = probe_disk(filename);
+		cout << ",\"format\":" << json_string(i.format);
+		cout << ",\"sector_size\":" << i.sector_size;
+		cout << ",\"sectors\":" << i.sector_count;
+		cout << ",\"filesystem\":" << json_string(i.filesystem);
+		cout << ",\"confidence\":" << i.confidence;
+		cout << ",\"free_sectors\":" << i.free_sectors;
+		cout << ",\"dos_sector\":" << i.dos_first_sector;
+	} catch (const char * msg) {
+		cout << ",\"error\":" << json_string(msg);
+	}
+	cout << "}\n";
+}
+
+// Extract single file without unpacking whole disk.
+
+void get(filesystem * fs, const string & path, const string & out)
+{
+	unique_ptr<filesystem::dir> dir(fs->lookup(path));
+	if (!dir) throw "file not found";
+	if (dir->is_dir()) throw "not a file";
+	unique_ptr<filesystem::file> file(dir->open_file());
+	file->save(out);
+}
+
+filesystem * open_filesystem(disk * d, ostream & warn = cerr)
+{
+	int confidence;
+	auto fs = detect_filesystem(d, &confidence);
+	if (confidence <= filesystem::detect_fallback) {
+		warn << "Warning: filesystem not recognized, using DOS " << fs->name() << ".\n";
+	}
+	return fs;
+}
+
+// List more disks. Images are loaded in the background and listed in parallel, output keeps the order of files.
+
+void list(const vector<string> & files)
+{
+	vector<string> out(files.size()), err(files.size());
+	vector<bool> done(files.size());
+	size_t next_print = 0;
+	mutex m;
+
+	batch_load(files, [&](size_t i, disk * d, const char * error) {
+		ostringstream o, e;
+		if (d) {
+			try {
+				unique_ptr<filesystem> fs(open_filesystem(d, e));
+				unpack(fs.get(), "", set<string>(), o);
+			} catch (const char * msg) {
+				error = msg;
+			}
+		}
+		if (error) e << "Error: " << error << "\n";
+
+		lock_guard<mutex> lock(m);
+		out[i] = o.str();
+		err[i] = e.str();
+		done[i] = true;
+		for (; next_print < files.size() && done[next_print]; next_print++) {
+			cout << files[next_print] << ":\n" << out[next_print];
+			cerr << err[next_print];
+			cout << "\n";
+			out[next_print].clear();
+			err[next_print].clear();
+		}
+	}, max(1u, thread::hardware_concurrency()));
+}
+
 const string help =
 "AtrCompiler v0.5\n"
 "\n"
 "Usage:\n"
-"AtrCompiler list   atr_file\n"
+"AtrCompiler list   atr_file...\n"
 "AtrCompiler pack   atr_file [dir_file]\n"
-"AtrCompiler unpack atr_file [dir_file]\n"
+"AtrCompiler unpack atr_file [dir_file] [-t[=EXT,...]]\n"
+"AtrCompiler info   atr_file...\n"
+"AtrCompiler get    atr_file path [out_file]\n"
+"AtrCompiler sparse atr_file...\n"
+"AtrCompiler bench\n"
+"\n"
+"-t  unpack files with specified extensions (TXT by default) as UTF-8 text\n"
 "\n";
 
-void disk_cache_test()
-{
-	disk::sector * s1;
-	auto d = new disk(128, 100);
+// Readers share one disk without locking, writer modifies it while holding disk::writer.
+// Run by hidden command test, built with ThreadSanitizer it checks there are no data races.
 
-	for (int i = 1; i < 10; i++) {
-		s1 = d->init_sector(i);
-		s1->poke(0, i);
+void disk_thread_test()
+{
+	const disk::sector_num count = 720;
+	auto d = new disk(128, count);
+
+	{
+		disk::writer lock(*d);
+		for (disk::sector_num i = 1; i <= count; i++) {
+			auto s = d->init_sector(i);
+			s.poke(0, byte(i));
+			s.poke(1, byte(i >> 8));
+		}
 	}
-	
-	s1 = d->get_sector(3);
-	assert(s1->peek(0) == 3);
 
-	s1 = d->get_sector(5);
-	assert(s1->peek(0) == 5);
+	atomic<bool> failed(false);
+	vector<thread> readers;
+	for (int t = 0; t < 8; t++) {
+		readers.emplace_back([d, t, &failed]() {
+			for (int pass = 0; pass < 100; pass++) {
+				for (disk::sector_num i = 1 + t; i <= count; i += 3) {
+					if (d->read_word(i, 0) != word(i)) failed = true;
+					auto s = d->get_sector(i);
+					if (s.dpeek(0) != word(i)) failed = true;
+				}
+			}
+		});
+	}
+	for (auto & r : readers) r.join();
+
+	vector<thread> writers;
+	for (int t = 0; t < 4; t++) {
+		writers.emplace_back([d, t]() {
+			disk::writer lock(*d);
+			for (disk::sector_num i = 1; i <= count; i++) {
+				d->write_byte(i, 2, byte(d->read_byte(i, 2) + 1));
+			}
+		});
+	}
+	for (auto & w : writers) w.join();
 
-	s1 = d->get_sector(5);
-	assert(s1->peek(0) == 5);
+	for (disk::sector_num i = 1; i <= count; i++) {
+		if (d->read_byte(i, 2) != 4) failed = true;
+	}
 
-	s1 = d->get_sector(5);
-	assert(s1->peek(0) == 5);
+	delete d;
+	if (failed) throw "disk thread test failed";
+	cout << "disk thread test passed\n";
+}
 
-	s1 = d->get_sector(3);
-	assert(s1->peek(0) == 3);
+// Speed of file reading and writing on DOS 2 disks, for every sector size (instantiation of the sector chain code).
 
+double mb_per_s(size_t bytes, chrono::steady_clock::duration t)
+{
+	return bytes / 1e6 / max(chrono::duration<double>(t).count(), 1e-9);
 }
 
+void bench()
+{
+	const int passes = 100;
+	char name[12] = "BENCH   BIN";
+
+	for (size_t ss : { 128, 256 }) {
+		chrono::steady_clock::duration write_t{}, read_t{}, byte_t{}, pread_t{};
+		vector<byte> data, out;
+
+		for (int pass = 0; pass < passes; pass++) {
+			disk d(ss, 720);
+			unique_ptr<filesystem> fs(find_filesystem_type("2")->format(&d));
+			unique_ptr<filesystem::dir> root(fs->root_dir());
+
+			if (data.empty()) {
+				data.resize(fs->free_sector_count() * (ss - 3) * 9 / 10);
+				for (size_t i = 0; i < data.size(); i++) data[i] = byte(i * 7 + (i >> 8));
+				out.resize(data.size());
+			}
+
+			auto t = chrono::steady_clock::now();
+			unique_ptr<filesystem::file>(root->create_file(name))->write_bytes(data.data(), data.size());
+			write_t += chrono::steady_clock::now() - t;
+
+			root->seek(0);
+			unique_ptr<filesystem::file> f(root->open_file());
+			t = chrono::steady_clock::now();
+			for (size_t pos = 0; pos < out.size(); ) {
+				auto n = f->read_bytes(out.data() + pos, min<size_t>(16384, out.size() - pos));
+				if (n == 0) break;
+				pos += n;
+			}
+			read_t += chrono::steady_clock::now() - t;
+			if (out != data) throw "bench: data read differ from data written";
+
+			f.reset(root->open_file());
+			t = chrono::steady_clock::now();
+			for (auto & b : out) b = f->read();
+			byte_t += chrono::steady_clock::now() - t;
+
+			t = chrono::steady_clock::now();
+			for (size_t pos = 0; pos < out.size(); pos += 4096) {
+				f->pread(pos, out.data() + pos, min<size_t>(4096, out.size() - pos));
+			}
+			pread_t += chrono::steady_clock::now() - t;
+			if (out != data) throw "bench: data read differ from data written";
+		}
+
+		auto bytes = data.size() * passes;
+		cout << "sector size " << setw(4) << ss << fixed << setprecision(1)
+			<< ": write " << setw(7) << mb_per_s(bytes, write_t) << " MB/s"
+			<< ", read " << setw(7) << mb_per_s(bytes, read_t) << " MB/s"
+			<< ", read by byte " << setw(7) << mb_per_s(bytes, byte_t) << " MB/s"
+			<< ", pread " << setw(7) << mb_per_s(bytes, pread_t) << " MB/s\n";
+	}
+}
 
 int main(int argc, char *argv[])
 {
 	/*
 
 	pack   .atr [dirfile]
-	unpack .atr [dirfile]
-	list   .atr
+	unpack .atr [dirfile] [-t[=ext,...]]
+	list   .atr...
+	info   .atr...
+	get    .atr path [file]
+	sparse .atr...
+	bench
+	test          (not in help, checks concurrent access to disk)
 
 	*/
 
-	//disk_cache_test();
-
 	string command;
 	int x = 1;
 	try {
@@ -373,9 +566,13 @@ int main(int argc, char *argv[])
 		} else {
 			if (strcmp(argv[x], "list") == 0) {
 				x++;
-				auto d = disk::load(argv[x++]);
-				auto fs = detect_filesystem(d);
-				unpack(fs, "");
+				if (argc - x > 1) {
+					list(vector<string>(argv + x, argv + argc));
+				} else {
+					auto d = disk::load(argv[x++]);
+					auto fs = open_filesystem(d);
+					unpack(fs, "");
+				}
 			} else if (strcmp(argv[x], "pack") == 0) {
 				x++;
 				string atr = argv[x++];
@@ -390,12 +587,49 @@ int main(int argc, char *argv[])
 				x++;
 				string atr = argv[x++];
 				string dir = "dir.txt";
+				set<string> text_ext;
+				for (; x < argc; x++) {
+					string arg = argv[x];
+					if (arg.compare(0, 2, "-t") == 0) {
+						string list = arg.size() > 3 && arg[2] == '=' ? arg.substr(3) : "TXT";
+						istringstream l(list);
+						string ext;
+						while (getline(l, ext, ',')) {
+							for (auto & c : ext) c = char(toupper((unsigned char)c));
+							text_ext.insert(ext);
+						}
+					} else {
+						dir = arg;
+					}
+				}
+				auto d = disk::load(atr);
+				auto fs = open_filesystem(d);
+				unpack(fs, dir, text_ext);
+			} else if (strcmp(argv[x], "info") == 0) {
+				x++;
+				for (; x < argc; x++) {
+					info(argv[x]);
+				}
+			} else if (strcmp(argv[x], "get") == 0) {
+				x++;
+				string atr = argv[x++];
+				string path = argv[x++];
+				string out = path.substr(path.find_last_of('/') + 1);
 				if (x < argc) {
-					dir = argv[x++];
+					out = argv[x++];
 				}
 				auto d = disk::load(atr);
-				auto fs = detect_filesystem(d);
-				unpack(fs, dir);
+				auto fs = open_filesystem(d);
+				get(fs, path, out);
+			} else if (strcmp(argv[x], "sparse") == 0) {
+				x++;
+				for (; x < argc; x++) {
+					cout << argv[x] << ": " << punch_holes(argv[x]) / 1024 << " KB freed\n";
+				}
+			} else if (strcmp(argv[x], "bench") == 0) {
+				bench();
+			} else if (strcmp(argv[x], "test") == 0) {
+				disk_thread_test();
 			}
 		}
 	} catch (const char * msg) {